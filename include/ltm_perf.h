@@ -0,0 +1,55 @@
+/*
+ * ltm_perf.h -- hardware performance counters for the refresh engine.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Header file for counting what each refresh step costs: CPU cycles,
+ * instructions, context switches and page faults.
+ *
+ */
+
+#ifndef LTM_PERF_H
+#define LTM_PERF_H
+
+#include <stdint.h>
+
+#define LTM_PERF_CYCLES 0
+#define LTM_PERF_INSTRUCTIONS 1
+#define LTM_PERF_CONTEXT_SWITCHES 2
+#define LTM_PERF_PAGE_FAULTS 3
+#define LTM_PERF_COUNTERS 4
+
+/* Distributions are kept as histograms with power-of-two buckets:
+   bucket 0 holds zeros, and bucket n holds values from 2^(n-1) up to
+   2^n - 1. */
+
+#define LTM_PERF_BUCKETS 40
+
+struct ltm_perf_dist {
+  unsigned long samples;
+  unsigned long long total;
+  unsigned long long max;
+  unsigned long buckets[LTM_PERF_BUCKETS];
+};
+
+struct ltm_perf {
+  int group_fd;
+  int nopen;
+  int order[LTM_PERF_COUNTERS];
+  int fd[LTM_PERF_COUNTERS];
+  uint64_t start[LTM_PERF_COUNTERS];
+  struct ltm_perf_dist dist[LTM_PERF_COUNTERS];
+};
+
+void ltm_perf_init(struct ltm_perf *p);
+int ltm_perf_open(struct ltm_perf *p);
+void ltm_perf_close(struct ltm_perf *p);
+void ltm_perf_begin(struct ltm_perf *p);
+void ltm_perf_end(struct ltm_perf *p);
+
+const char *ltm_perf_name(int counter);
+int ltm_perf_available(const struct ltm_perf *p, int counter);
+unsigned long long ltm_perf_percentile(const struct ltm_perf_dist *d,
+                                       int percent);
+
+#endif
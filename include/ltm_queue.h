@@ -0,0 +1,63 @@
+/*
+ * ltm_queue.h -- lock-free update queue for the LTM-Y2K19JF-03 display.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Header file for the queue that lets any number of threads post
+ * display updates to the refresh engine without taking its lock.
+ *
+ */
+
+#ifndef LTM_QUEUE_H
+#define LTM_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "ltmy2k19jf03.h"
+
+/* Number of updates the queue can hold; must be a power of two. */
+
+#define LTM_QUEUE_SIZE 64
+
+/* Most updates applied at one cycle boundary, so a flood of posts
+   can't stretch out a cycle. */
+
+#define LTM_QUEUE_BATCH 16
+
+/* Update types. */
+
+#define LTM_UPDATE_FIELD 1       /* data.text into field */
+#define LTM_UPDATE_FRAME 2       /* data.frame replaces everything */
+#define LTM_UPDATE_SET_MASK 3    /* light the segments in data.frame */
+#define LTM_UPDATE_CLEAR_MASK 4  /* turn off the segments in data.frame */
+
+struct ltm_update {
+  int type;
+  int field;
+  union {
+    char text[LTM_ALPHANUM_LEN + 1];
+    uint8_t frame[5][5];
+  } data;
+};
+
+struct ltm_queue_slot {
+  atomic_size_t seq;
+  struct ltm_update update;
+};
+
+struct ltm_queue {
+  struct ltm_queue_slot slots[LTM_QUEUE_SIZE];
+  atomic_size_t head;
+  size_t tail;
+  atomic_ulong dropped;
+};
+
+void ltm_queue_init(struct ltm_queue *q);
+int ltm_queue_post(struct ltm_queue *q, const struct ltm_update *update);
+int ltm_queue_take(struct ltm_queue *q, struct ltm_update *update);
+
+void ltm_apply_update(const struct ltm_update *update, uint8_t block[5][5]);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * ltm_refresh.h -- refresh engine for the LTM-Y2K19JF-03 display.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Header file for the routines that cycle through the five groups of
+ * a frame, keeping the whole display lit.
+ *
+ */
+
+#ifndef LTM_REFRESH_H
+#define LTM_REFRESH_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ltm_transition.h"
+#include "ltm_queue.h"
+#include "ltm_perf.h"
+
+struct ltm_runner;
+
+/* Default time each group stays selected, and the shortest time we
+   allow a group to stay lit when the power cap shortens the dwell. */
+
+#define LTM_REFRESH_PERIOD_US 2000
+#define LTM_REFRESH_MIN_ON_US 100
+
+/* How long to wait before trying again when a frame couldn't be
+   written to the kernel device. */
+
+#define LTM_REFRESH_DEVICE_RETRY_US 100000
+
+/* A step that starts more than this late counts as a missed
+   deadline; the group before it stays lit visibly longer than the
+   others. */
+
+#define LTM_REFRESH_SLACK_US 200
+
+/* Default drive current for a single lit segment, used to estimate
+   the load.  The ST2225A is a constant-current driver, so this only
+   depends on the current-setting resistor on the board. */
+
+#define LTM_SEGMENT_MA 10
+
+struct ltm_refresh_stats {
+  unsigned long cycles;
+  int lit_segments[5];
+  long load_ma;
+  long capped_load_ma;
+  int duty_permille;
+  unsigned long steps;
+  unsigned long overruns;
+  unsigned long deadline_misses;
+  long late_max_us;
+  long long late_total_us;
+  double late_squares_us2;
+  long long cpu_us;
+  long first_step_us;
+  unsigned long write_errors;
+  int write_errno;
+  unsigned long queue_updates;
+  unsigned long parks;
+};
+
+struct ltm_refresh {
+  uint8_t frame[5][5];
+  uint8_t target[5][5];
+  struct ltm_frame sequence[LTM_TRANSITION_MAX_FRAMES];
+  int sequence_len;
+  int sequence_pos;
+  int sequence_cycles;
+  int group;
+  int lit;
+  struct ltm_display *display;
+  int device_fd;
+  uint8_t written[5][5];
+  long period_us;
+  long on_us;
+  long segment_ma;
+  long power_cap_ma;
+  int park_when_blank;
+  struct ltm_queue *queue;
+  struct ltm_refresh_stats stats;
+  int perf_enabled;
+  struct ltm_perf perf;
+
+  /* For running the engine in its own thread. */
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t stepped;
+  int running;
+  int kicked;
+  struct timespec started;
+
+  /* Or in one of a runner's threads (see ltm_runner.h). */
+
+  struct ltm_runner *runner;
+  int runner_slot;
+};
+
+void ltm_refresh_init(struct ltm_refresh *r, long period_us);
+void ltm_refresh_set_power_cap(struct ltm_refresh *r, long segment_ma,
+                               long cap_ma);
+void ltm_refresh_set_frame(struct ltm_refresh *r, const uint8_t frame[5][5]);
+void ltm_refresh_play(struct ltm_refresh *r, const struct ltm_frame *frames,
+                      int nframes, const uint8_t target[5][5]);
+void ltm_refresh_set_display(struct ltm_refresh *r, struct ltm_display *d);
+void ltm_refresh_set_device(struct ltm_refresh *r, int fd);
+void ltm_refresh_set_queue(struct ltm_refresh *r, struct ltm_queue *q);
+long ltm_refresh_step(struct ltm_refresh *r);
+long ltm_refresh_scheduled_step(struct ltm_refresh *r, long late_us,
+                                int *idle);
+
+int ltm_refresh_start(struct ltm_refresh *r, int priority);
+void ltm_refresh_stop(struct ltm_refresh *r);
+void ltm_refresh_wait_first_step(struct ltm_refresh *r);
+void ltm_refresh_enable_perf(struct ltm_refresh *r);
+void ltm_refresh_lock(struct ltm_refresh *r);
+void ltm_refresh_unlock(struct ltm_refresh *r);
+
+#endif
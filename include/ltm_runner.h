@@ -0,0 +1,51 @@
+/*
+ * ltm_runner.h -- shared refresh threads for many display modules.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Header file for running several refresh engines from a pool of
+ * real-time threads, each pinned to its own core.
+ *
+ */
+
+#ifndef LTM_RUNNER_H
+#define LTM_RUNNER_H
+
+#include <time.h>
+#include <pthread.h>
+
+#include "ltm_refresh.h"
+
+#define LTM_RUNNER_MAX_ENGINES 16
+#define LTM_RUNNER_MAX_THREADS 8
+
+/* Scheduling state for one engine: when its next step is due,
+   whether a thread is stepping it right now, and whether it's idle
+   (only waiting to be changed, or to look at its queue).  An idle
+   engine with no due time is parked. */
+
+struct ltm_runner_slot {
+  struct ltm_refresh *engine;
+  struct timespec due;
+  int busy;
+  int idle;
+  int parked;
+};
+
+struct ltm_runner {
+  struct ltm_runner_slot slots[LTM_RUNNER_MAX_ENGINES];
+  int nengines;
+  pthread_t threads[LTM_RUNNER_MAX_THREADS];
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int running;
+};
+
+void ltm_runner_init(struct ltm_runner *run);
+int ltm_runner_add(struct ltm_runner *run, struct ltm_refresh *r);
+int ltm_runner_start(struct ltm_runner *run, int nthreads, int priority);
+void ltm_runner_stop(struct ltm_runner *run);
+void ltm_runner_kick(struct ltm_runner *run, struct ltm_refresh *r);
+
+#endif
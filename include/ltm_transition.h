@@ -0,0 +1,45 @@
+/*
+ * ltm_transition.h -- transition effects for the LTM-Y2K19JF-03
+ *                     display.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Header file for the routines that generate the frames shown when
+ * a field changes.
+ *
+ */
+
+#ifndef LTM_TRANSITION_H
+#define LTM_TRANSITION_H
+
+#include <stdint.h>
+
+/* The fields a transition can apply to. */
+
+#define LTM_FIELD_ALPHANUM 0
+#define LTM_FIELD_NUMERIC 1
+
+/* The available effects. */
+
+#define LTM_TRANSITION_NONE 0
+#define LTM_TRANSITION_WIPE 1
+#define LTM_TRANSITION_BUILD 2
+#define LTM_TRANSITION_SLIDE 3
+#define LTM_TRANSITION_FADE 4
+
+#define LTM_TRANSITION_MAX_FRAMES 64
+
+/* A single frame of a transition, shown for "cycles" passes through
+   all five groups. */
+
+struct ltm_frame {
+  uint8_t block[5][5];
+  int cycles;
+};
+
+int ltm_transition_find(const char *name);
+int ltm_transition_build(int effect, int field,
+                         const uint8_t from[5][5], const uint8_t to[5][5],
+                         int cycles, struct ltm_frame *frames);
+
+#endif
@@ -8,8 +8,45 @@
  *
  */
 
+#ifndef LTMY2K19JF03_H
+#define LTMY2K19JF03_H
+
 #include <stdint.h>
 
+/* Sizes of the two text fields. */
+
+#define LTM_ALPHANUM_LEN 7
+#define LTM_NUMERIC_LEN 4
+
+/* The individually addressable colon dots, for ltm_render_colons().
+   The numeric field borrows one of them as a decimal point, which
+   sits after LTM_NUMERIC_POINT_POS digits. */
+
+#define LTM_COLON_1_UPPER 0x01
+#define LTM_COLON_1_LOWER 0x02
+#define LTM_COLON_2_UPPER 0x04
+#define LTM_COLON_2_LOWER 0x08
+
+#define LTM_NUMERIC_POINT LTM_COLON_2_LOWER
+#define LTM_NUMERIC_POINT_POS 2
+
+/* One display module, and the pins it's wired to. */
+
+struct ltm_display {
+  int data_pin;
+  int clock_pin;
+  int reset_pin;
+};
+
+int ltm_display_open(struct ltm_display *d, int data_pin, int clock_pin,
+                     int reset_pin);
+void ltm_display_close(struct ltm_display *d);
+int ltm_display_clear(struct ltm_display *d);
+void ltm_display_blast_block(struct ltm_display *d,
+                             const uint8_t render_block[5]);
+
+/* The same, for a single default display. */
+
 int ltm_display_init(int data_pin, int clock_pin, int reset_pin);
 void ltm_display_shutdown();
 
@@ -19,10 +56,20 @@ int ltm_clear();
 
 void ltm_blast_block(const uint8_t render_block[5]);
 
+void ltm_select_groups(uint8_t block[5][5]);
+int ltm_count_lit_segments(const uint8_t render_block[5]);
+
 uint16_t ltm_find_alphanum_code(char c);
 uint8_t ltm_find_numeric_code(char c);
 
 void ltm_clear_alphanum(uint8_t block[5][5]);
+void ltm_set_alphanum_code(int pos, uint16_t code, uint8_t block[5][5]);
+uint16_t ltm_get_alphanum_code(int pos, const uint8_t block[5][5]);
 void ltm_render_alphanum(const char *render, uint8_t block[5][5]);
 void ltm_clear_numeric(uint8_t block[5][5]);
+void ltm_set_numeric_code(int pos, uint8_t code, uint8_t block[5][5]);
+uint8_t ltm_get_numeric_code(int pos, const uint8_t block[5][5]);
 void ltm_render_numeric(const char *render, uint8_t block[5][5]);
+void ltm_render_colons(uint8_t dots, uint8_t block[5][5]);
+
+#endif
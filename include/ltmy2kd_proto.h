@@ -0,0 +1,80 @@
+/*
+ * ltmy2kd_proto.h -- binary command protocol for ltmy2kd.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Besides the text commands, ltmy2kd takes fixed-size binary
+ * messages, on both the command pipe and the command socket.  Every
+ * message is LTM_MSG_SIZE bytes: a header giving the opcode, the
+ * field it applies to, some flags and a sequence number, followed by
+ * the payload for that opcode.  Multi-byte values are in host byte
+ * order; this is only ever spoken on the local machine.
+ *
+ * The first byte of each message is LTM_MSG_MAGIC, which can't start
+ * a text command, so the two can be mixed on the same pipe.
+ *
+ * A transaction only holds back changes made through the pipe or
+ * socket it was begun on.  On the socket it ends with the datagram;
+ * on the pipe it times out if the commit doesn't come soon.
+ */
+
+#ifndef LTMY2KD_PROTO_H
+#define LTMY2KD_PROTO_H
+
+#include <stdint.h>
+
+#define LTM_MSG_MAGIC 0xA5
+#define LTM_MSG_SIZE 40
+
+/* Opcodes. */
+
+#define LTM_OP_SET_FIELD 1     /* payload.text: new text for the field */
+#define LTM_OP_RAW_FRAME 2     /* payload.frame: all five groups */
+#define LTM_OP_SEGMENT_MASK 3  /* payload.frame: segments to light */
+#define LTM_OP_VALUE 4         /* payload.value: number to format */
+#define LTM_OP_BEGIN 5         /* hold display changes... */
+#define LTM_OP_COMMIT 6        /* ...until this, then show them at once */
+
+/* Fields.  RAW_FRAME and SEGMENT_MASK use the field byte for the
+   module instead, counting from 0 at the left of the panel. */
+
+#define LTM_MSG_FIELD_ALPHA 0
+#define LTM_MSG_FIELD_NUM 1
+
+/* Flags. */
+
+#define LTM_MSG_FLAG_CLEAR 0x01  /* SEGMENT_MASK: turn segments off */
+#define LTM_MSG_FLAG_SIGN 0x02   /* VALUE: always leave room for a sign */
+
+struct ltm_msg_header {
+  uint8_t magic;
+  uint8_t opcode;
+  uint8_t field;
+  uint8_t flags;
+  uint16_t seq;
+  uint16_t reserved;
+};
+
+/* A number for the VALUE opcode: value / 10^scale, shown with the
+   given width and decimals.  The deadband has the same scale. */
+
+struct ltm_msg_value {
+  int32_t value;
+  int32_t deadband;
+  uint8_t scale;
+  uint8_t width;
+  uint8_t decimals;
+  uint8_t reserved;
+  char units[8];
+};
+
+struct ltm_msg {
+  struct ltm_msg_header header;
+  union {
+    char text[32];
+    uint8_t frame[5][5];
+    struct ltm_msg_value value;
+  } payload;
+};
+
+#endif
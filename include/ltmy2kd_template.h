@@ -0,0 +1,41 @@
+/*
+ * ltmy2kd_template.h -- templated messages for ltmy2kd.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Header file for the message templates and the internal data
+ * sources they draw on.
+ *
+ */
+
+#ifndef LTMY2KD_TEMPLATE_H
+#define LTMY2KD_TEMPLATE_H
+
+#include <stddef.h>
+
+#define TEMPLATE_MAX_PARTS 16
+#define TEMPLATE_MAX_TEXT 8
+
+/* A compiled template is a list of parts, each either some literal
+   text (source is -1) or a data source shown in a given width. */
+
+struct template_part {
+  int source;
+  int width;
+  int zero_pad;
+  char text[TEMPLATE_MAX_TEXT];
+};
+
+struct template {
+  int nparts;
+  struct template_part parts[TEMPLATE_MAX_PARTS];
+};
+
+int template_compile(const char *text, struct template *t);
+void template_expand(const struct template *t, char *out, size_t out_len);
+
+void sources_clear_use();
+void sources_use(const struct template *t);
+long sources_update(int *changed);
+
+#endif
@@ -0,0 +1,380 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ltmy2k.c -- kernel driver for the LTM-Y2K19JF-03 multi-segment
+ *             display.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * This does the same job as the refresh loop in ltmy2kd, but from an
+ * hrtimer in the kernel: it owns the data, clock and reset GPIOs and
+ * cycles through the five segment groups, so user space doesn't have
+ * to busy-wait or run at real-time priority.
+ *
+ * Frames are written to /dev/ltmy2k as 25 bytes: the five 5-byte
+ * group blocks, in the same layout ltm_blast_block() takes (group
+ * select bits included).  A new frame is swapped in at the start of
+ * the next pass through the groups, so user space only has to write
+ * when the content changes.
+ *
+ * The pins come from the device tree ("liteon,ltm-y2k19jf03", with
+ * data-gpios, clock-gpios and reset-gpios), or, if there's no device
+ * tree node, from the gpio_chip and data/clock/reset module
+ * parameters, which name a GPIO chip and line offsets on it.  The
+ * latter makes it easy to try out against gpio-sim in a VM.
+ *
+ * If the GPIO lines can be set from atomic context, each group is
+ * sent straight from the timer.  Otherwise (gpio-sim, or GPIO
+ * expanders on a slow bus), the timer wakes a real-time kernel
+ * thread to do it.
+ */
+
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/machine.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/mod_devicetable.h>
+#include <linux/platform_device.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#define LTMY2K_GROUPS 5
+#define LTMY2K_GROUP_BYTES 5
+#define LTMY2K_FRAME_BYTES (LTMY2K_GROUPS * LTMY2K_GROUP_BYTES)
+
+static char *gpio_chip;
+module_param(gpio_chip, charp, 0444);
+MODULE_PARM_DESC(gpio_chip, "GPIO chip label, if not using the device tree");
+
+static unsigned int data_line = 22;
+module_param_named(data, data_line, uint, 0444);
+MODULE_PARM_DESC(data, "data line offset on gpio_chip (default 22)");
+
+static unsigned int clock_line = 17;
+module_param_named(clock, clock_line, uint, 0444);
+MODULE_PARM_DESC(clock, "clock line offset on gpio_chip (default 17)");
+
+static unsigned int reset_line = 27;
+module_param_named(reset, reset_line, uint, 0444);
+MODULE_PARM_DESC(reset, "reset line offset on gpio_chip (default 27)");
+
+static unsigned int period_us = 2000;
+module_param(period_us, uint, 0444);
+MODULE_PARM_DESC(period_us, "time each group stays lit, in microseconds");
+
+struct ltmy2k {
+	struct device *dev;
+	struct gpio_desc *data;
+	struct gpio_desc *clock;
+	struct gpio_desc *reset;
+	bool cansleep;
+
+	struct hrtimer timer;
+	ktime_t period;
+	struct task_struct *thread;
+
+	/* Protected by lock: the frame written by user space, waiting to
+	   be picked up at the start of the next cycle. */
+	spinlock_t lock;
+	u8 pending[LTMY2K_FRAME_BYTES];
+	bool have_pending;
+
+	/* Only touched by the timer (or the thread it wakes). */
+	u8 frame[LTMY2K_FRAME_BYTES];
+	int group;
+
+	struct miscdevice misc;
+};
+
+static void ltmy2k_set(struct ltmy2k *ltm, struct gpio_desc *desc, int value)
+{
+	if (ltm->cansleep)
+		gpiod_set_value_cansleep(desc, value);
+	else
+		gpiod_set_value(desc, value);
+}
+
+/* Send a single bit; same timing as blast_bit() in the library. */
+
+static void ltmy2k_send_bit(struct ltmy2k *ltm, int bit)
+{
+	ltmy2k_set(ltm, ltm->clock, 0);
+	ltmy2k_set(ltm, ltm->data, bit & 0x01);
+	udelay(1);
+	ltmy2k_set(ltm, ltm->clock, 1);
+	udelay(1);
+	ltmy2k_set(ltm, ltm->clock, 0);
+}
+
+/* Send the next group, picking up a new frame first if this is the
+   start of a cycle. */
+
+static void ltmy2k_send_group(struct ltmy2k *ltm)
+{
+	const u8 *block;
+	unsigned long flags;
+	int i, j;
+	u8 byte;
+
+	if (ltm->group == 0) {
+		spin_lock_irqsave(&ltm->lock, flags);
+		if (ltm->have_pending) {
+			memcpy(ltm->frame, ltm->pending, LTMY2K_FRAME_BYTES);
+			ltm->have_pending = false;
+		}
+		spin_unlock_irqrestore(&ltm->lock, flags);
+	}
+
+	block = &ltm->frame[ltm->group * LTMY2K_GROUP_BYTES];
+
+	ltmy2k_send_bit(ltm, 1);
+	for (i = 0; i < LTMY2K_GROUP_BYTES; i++) {
+		byte = block[i];
+		if (i == LTMY2K_GROUP_BYTES - 1)
+			byte &= 0xc0;
+		for (j = 7; j >= 0; j--)
+			ltmy2k_send_bit(ltm, byte >> j);
+	}
+
+	ltm->group = (ltm->group + 1) % LTMY2K_GROUPS;
+}
+
+static enum hrtimer_restart ltmy2k_timer(struct hrtimer *timer)
+{
+	struct ltmy2k *ltm = container_of(timer, struct ltmy2k, timer);
+
+	if (ltm->cansleep)
+		wake_up_process(ltm->thread);
+	else
+		ltmy2k_send_group(ltm);
+
+	hrtimer_forward_now(timer, ltm->period);
+	return HRTIMER_RESTART;
+}
+
+static int ltmy2k_thread(void *arg)
+{
+	struct ltmy2k *ltm = arg;
+
+	sched_set_fifo(current);
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule();
+		if (kthread_should_stop())
+			break;
+		ltmy2k_send_group(ltm);
+	}
+
+	return 0;
+}
+
+static ssize_t ltmy2k_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct ltmy2k *ltm = container_of(file->private_data, struct ltmy2k,
+					  misc);
+	u8 frame[LTMY2K_FRAME_BYTES];
+	unsigned long flags;
+
+	if (count != LTMY2K_FRAME_BYTES)
+		return -EINVAL;
+	if (copy_from_user(frame, buf, LTMY2K_FRAME_BYTES))
+		return -EFAULT;
+
+	spin_lock_irqsave(&ltm->lock, flags);
+	memcpy(ltm->pending, frame, LTMY2K_FRAME_BYTES);
+	ltm->have_pending = true;
+	spin_unlock_irqrestore(&ltm->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations ltmy2k_fops = {
+	.owner = THIS_MODULE,
+	.write = ltmy2k_write,
+	.llseek = noop_llseek,
+};
+
+static int ltmy2k_probe(struct platform_device *pdev)
+{
+	struct device *dev = &pdev->dev;
+	struct ltmy2k *ltm;
+	int ret;
+
+	ltm = devm_kzalloc(dev, sizeof(*ltm), GFP_KERNEL);
+	if (!ltm)
+		return -ENOMEM;
+
+	ltm->dev = dev;
+	spin_lock_init(&ltm->lock);
+
+	ltm->data = devm_gpiod_get(dev, "data", GPIOD_OUT_LOW);
+	if (IS_ERR(ltm->data))
+		return dev_err_probe(dev, PTR_ERR(ltm->data), "no data GPIO\n");
+	ltm->clock = devm_gpiod_get(dev, "clock", GPIOD_OUT_LOW);
+	if (IS_ERR(ltm->clock))
+		return dev_err_probe(dev, PTR_ERR(ltm->clock), "no clock GPIO\n");
+	ltm->reset = devm_gpiod_get(dev, "reset", GPIOD_OUT_LOW);
+	if (IS_ERR(ltm->reset))
+		return dev_err_probe(dev, PTR_ERR(ltm->reset), "no reset GPIO\n");
+
+	ltm->cansleep = gpiod_cansleep(ltm->data) ||
+		gpiod_cansleep(ltm->clock) || gpiod_cansleep(ltm->reset);
+
+	/* Reset the display, as ltm_clear() does. */
+
+	ltmy2k_set(ltm, ltm->reset, 1);
+	udelay(1);
+	ltmy2k_set(ltm, ltm->reset, 0);
+
+	if (ltm->cansleep) {
+		ltm->thread = kthread_run(ltmy2k_thread, ltm, "ltmy2k");
+		if (IS_ERR(ltm->thread))
+			return PTR_ERR(ltm->thread);
+	}
+
+	ltm->misc.minor = MISC_DYNAMIC_MINOR;
+	ltm->misc.name = "ltmy2k";
+	ltm->misc.fops = &ltmy2k_fops;
+	ltm->misc.parent = dev;
+	ret = misc_register(&ltm->misc);
+	if (ret)
+		goto err_thread;
+
+	ltm->period = us_to_ktime(period_us);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&ltm->timer, ltmy2k_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&ltm->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ltm->timer.function = ltmy2k_timer;
+#endif
+	hrtimer_start(&ltm->timer, ltm->period, HRTIMER_MODE_REL);
+
+	platform_set_drvdata(pdev, ltm);
+	dev_info(dev, "refreshing every %u us%s\n", period_us,
+		 ltm->cansleep ? " (from a thread)" : "");
+	return 0;
+
+err_thread:
+	if (ltm->thread)
+		kthread_stop(ltm->thread);
+	return ret;
+}
+
+static void ltmy2k_remove(struct platform_device *pdev)
+{
+	struct ltmy2k *ltm = platform_get_drvdata(pdev);
+
+	hrtimer_cancel(&ltm->timer);
+	misc_deregister(&ltm->misc);
+	if (ltm->thread)
+		kthread_stop(ltm->thread);
+
+	ltmy2k_set(ltm, ltm->reset, 1);
+	udelay(1);
+	ltmy2k_set(ltm, ltm->reset, 0);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+static int ltmy2k_remove_old(struct platform_device *pdev)
+{
+	ltmy2k_remove(pdev);
+	return 0;
+}
+#endif
+
+static const struct of_device_id ltmy2k_of_match[] = {
+	{ .compatible = "liteon,ltm-y2k19jf03" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, ltmy2k_of_match);
+
+static struct platform_driver ltmy2k_driver = {
+	.probe = ltmy2k_probe,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+	.remove = ltmy2k_remove,
+#else
+	.remove = ltmy2k_remove_old,
+#endif
+	.driver = {
+		.name = "ltmy2k",
+		.of_match_table = ltmy2k_of_match,
+	},
+};
+
+/* Without a device tree node, make our own device and hook the pins
+   named by the module parameters up to it. */
+
+static struct platform_device *ltmy2k_pdev;
+static struct gpiod_lookup_table *ltmy2k_lookup;
+
+static int ltmy2k_create_device(void)
+{
+	ltmy2k_lookup = kzalloc(struct_size(ltmy2k_lookup, table, 4),
+				GFP_KERNEL);
+	if (!ltmy2k_lookup)
+		return -ENOMEM;
+
+	ltmy2k_lookup->dev_id = "ltmy2k.0";
+	ltmy2k_lookup->table[0] =
+		GPIO_LOOKUP(gpio_chip, data_line, "data", GPIO_ACTIVE_HIGH);
+	ltmy2k_lookup->table[1] =
+		GPIO_LOOKUP(gpio_chip, clock_line, "clock", GPIO_ACTIVE_HIGH);
+	ltmy2k_lookup->table[2] =
+		GPIO_LOOKUP(gpio_chip, reset_line, "reset", GPIO_ACTIVE_HIGH);
+	gpiod_add_lookup_table(ltmy2k_lookup);
+
+	ltmy2k_pdev = platform_device_register_simple("ltmy2k", 0, NULL, 0);
+	if (IS_ERR(ltmy2k_pdev)) {
+		gpiod_remove_lookup_table(ltmy2k_lookup);
+		kfree(ltmy2k_lookup);
+		return PTR_ERR(ltmy2k_pdev);
+	}
+
+	return 0;
+}
+
+static int __init ltmy2k_init(void)
+{
+	int ret;
+
+	if (period_us < 100)
+		return -EINVAL;
+
+	ret = platform_driver_register(&ltmy2k_driver);
+	if (ret)
+		return ret;
+
+	if (gpio_chip) {
+		ret = ltmy2k_create_device();
+		if (ret)
+			platform_driver_unregister(&ltmy2k_driver);
+	}
+
+	return ret;
+}
+
+static void __exit ltmy2k_exit(void)
+{
+	if (ltmy2k_pdev) {
+		platform_device_unregister(ltmy2k_pdev);
+		gpiod_remove_lookup_table(ltmy2k_lookup);
+		kfree(ltmy2k_lookup);
+	}
+	platform_driver_unregister(&ltmy2k_driver);
+}
+
+module_init(ltmy2k_init);
+module_exit(ltmy2k_exit);
+
+MODULE_AUTHOR("Jeff Licquia <jeff@licquia.org>");
+MODULE_DESCRIPTION("LTM-Y2K19JF-03 multi-segment display driver");
+MODULE_LICENSE("GPL");
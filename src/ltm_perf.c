@@ -0,0 +1,238 @@
+/*
+ * ltm_perf.c -- hardware performance counters for the refresh engine.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * CPU time alone doesn't say why a refresh step was slow: it could be
+ * waiting on the GPIO hardware, being preempted, or missing in the
+ * cache or TLB.  These routines count CPU cycles, instructions,
+ * context switches and page faults on the refresh thread, read them
+ * before and after each step (one group sent to the display), and
+ * keep a distribution of each.  Few instructions over many cycles
+ * points at the GPIO writes or memory stalls; a context switch in
+ * the middle of a step is a preemption; page faults mean something
+ * wasn't locked into memory.
+ *
+ * The counters come from perf_event_open(), so they're only there on
+ * Linux, and only those the kernel lets us have (see
+ * /proc/sys/kernel/perf_event_paranoid; many boards have no
+ * hardware counters at all).  Whatever can be opened is put in one
+ * group, so a single read() gets all of them.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "ltm_perf.h"
+
+static const char *counter_names[LTM_PERF_COUNTERS] =
+  { "cycles", "instructions", "context_switches", "page_faults" };
+
+/* Set up with no counters open and empty distributions. */
+
+void ltm_perf_init(struct ltm_perf *p)
+{
+  int i;
+
+  memset(p, 0, sizeof(struct ltm_perf));
+  p->group_fd = -1;
+  for (i = 0; i < LTM_PERF_COUNTERS; i++) {
+    p->fd[i] = -1;
+  }
+}
+
+#ifdef __linux__
+
+static int open_counter(uint32_t type, uint64_t config, int group_fd)
+{
+  struct perf_event_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.disabled = (group_fd < 0);
+
+  /* Count the kernel's part of the GPIO writes if we may; if not,
+     settle for user space. */
+
+  fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+  if ((fd < 0) && ((errno == EACCES) || (errno == EPERM))) {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+  }
+
+  return fd;
+}
+
+/* Open whichever counters we can for the calling thread, and start
+   them.  Returns how many were opened. */
+
+int ltm_perf_open(struct ltm_perf *p)
+{
+  static const uint32_t types[LTM_PERF_COUNTERS] =
+    { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+      PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE };
+  static const uint64_t configs[LTM_PERF_COUNTERS] =
+    { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_SW_CONTEXT_SWITCHES, PERF_COUNT_SW_PAGE_FAULTS };
+  int i, fd;
+
+  for (i = 0; i < LTM_PERF_COUNTERS; i++) {
+    fd = open_counter(types[i], configs[i], p->group_fd);
+    if (fd < 0) {
+      continue;
+    }
+    if (p->group_fd < 0) {
+      p->group_fd = fd;
+    }
+    p->fd[i] = fd;
+    p->order[p->nopen++] = i;
+  }
+
+  if (p->group_fd >= 0) {
+    ioctl(p->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(p->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  return p->nopen;
+}
+
+/* Read the whole group: the number of counters, then each value, in
+   the order they were opened. */
+
+static int read_counters(struct ltm_perf *p, uint64_t *values)
+{
+  uint64_t buf[1 + LTM_PERF_COUNTERS];
+  int i;
+
+  if (p->group_fd < 0) {
+    return -1;
+  }
+  if (read(p->group_fd, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) {
+    return -1;
+  }
+
+  for (i = 0; (i < p->nopen) && ((uint64_t)i < buf[0]); i++) {
+    values[p->order[i]] = buf[1 + i];
+  }
+  return 0;
+}
+
+#else
+
+int ltm_perf_open(struct ltm_perf *p)
+{
+  return 0;
+}
+
+static int read_counters(struct ltm_perf *p, uint64_t *values)
+{
+  return -1;
+}
+
+#endif
+
+/* Close the counters, keeping the distributions. */
+
+void ltm_perf_close(struct ltm_perf *p)
+{
+  int i;
+
+  for (i = 0; i < LTM_PERF_COUNTERS; i++) {
+    if (p->fd[i] >= 0) {
+      close(p->fd[i]);
+      p->fd[i] = -1;
+    }
+  }
+  p->group_fd = -1;
+}
+
+/* Mark the start and end of a step.  Each counter's change over the
+   step goes into its distribution. */
+
+void ltm_perf_begin(struct ltm_perf *p)
+{
+  read_counters(p, p->start);
+}
+
+static void record(struct ltm_perf_dist *d, uint64_t value)
+{
+  int bucket = 0;
+
+  while ((bucket < LTM_PERF_BUCKETS - 1) && (value >> bucket)) {
+    bucket++;
+  }
+
+  d->samples++;
+  d->total += value;
+  if (value > d->max) {
+    d->max = value;
+  }
+  d->buckets[bucket]++;
+}
+
+void ltm_perf_end(struct ltm_perf *p)
+{
+  uint64_t now[LTM_PERF_COUNTERS];
+  int i;
+
+  if (read_counters(p, now) != 0) {
+    return;
+  }
+
+  for (i = 0; i < p->nopen; i++) {
+    record(&p->dist[p->order[i]], now[p->order[i]] - p->start[p->order[i]]);
+  }
+}
+
+const char *ltm_perf_name(int counter)
+{
+  return counter_names[counter];
+}
+
+/* Whether a counter was opened, and so has a distribution worth
+   looking at (even after the counters are closed). */
+
+int ltm_perf_available(const struct ltm_perf *p, int counter)
+{
+  int i;
+
+  for (i = 0; i < p->nopen; i++) {
+    if (p->order[i] == counter) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* An upper bound on the given percentile of a distribution: the top
+   of the bucket it falls in, or the maximum if that's lower. */
+
+unsigned long long ltm_perf_percentile(const struct ltm_perf_dist *d,
+                                       int percent)
+{
+  unsigned long long bound;
+  unsigned long seen = 0;
+  int i;
+
+  for (i = 0; i < LTM_PERF_BUCKETS; i++) {
+    seen += d->buckets[i];
+    if (seen * 100 >= d->samples * (unsigned long)percent) {
+      break;
+    }
+  }
+
+  bound = (i == 0) ? 0 : (1ULL << i) - 1;
+  return (bound < d->max) ? bound : d->max;
+}
@@ -0,0 +1,135 @@
+/*
+ * ltm_queue.c -- lock-free update queue for the LTM-Y2K19JF-03 display.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Programs that link the library and update the display from several
+ * threads can post updates here instead of taking the refresh
+ * engine's lock.  The refresh thread usually runs at real-time
+ * priority, and a poster holding the lock when it wakes up would
+ * delay it; with the queue, posters never block, and never make the
+ * refresh thread wait.
+ *
+ * This is a bounded ring of slots, each with a sequence number that
+ * says whose turn it is: a poster claims the next slot by advancing
+ * the head with a compare-and-swap, fills it in, and then publishes
+ * it by bumping the slot's sequence number.  There's only ever one
+ * taker (the refresh engine, which drains the queue at cycle
+ * boundaries), so the tail needs no atomics at all.  If the queue is
+ * full, posting fails rather than waiting.
+ */
+
+#include <string.h>
+
+#include "ltm_transition.h"
+#include "ltm_queue.h"
+
+typedef char ltm_queue_size_check[((LTM_QUEUE_SIZE &
+                                    (LTM_QUEUE_SIZE - 1)) == 0) ? 1 : -1];
+
+/* Set up an empty queue.  Each slot starts out ready for the poster
+   that will claim it first. */
+
+void ltm_queue_init(struct ltm_queue *q)
+{
+  size_t i;
+
+  for (i = 0; i < LTM_QUEUE_SIZE; i++) {
+    atomic_init(&q->slots[i].seq, i);
+  }
+  atomic_init(&q->head, 0);
+  q->tail = 0;
+  atomic_init(&q->dropped, 0);
+}
+
+/* Post an update; safe from any number of threads at once.  Returns
+   0, or -1 if the queue is full (the update is dropped and
+   counted). */
+
+int ltm_queue_post(struct ltm_queue *q, const struct ltm_update *update)
+{
+  struct ltm_queue_slot *slot;
+  size_t pos, seq;
+
+  pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  while (1) {
+    slot = &q->slots[pos & (LTM_QUEUE_SIZE - 1)];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if ((ptrdiff_t)(seq - pos) < 0) {
+      atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+
+  slot->update = *update;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+/* Take the oldest update, for the one thread draining the queue.
+   Returns 1 if there was one, or 0 if the queue is empty. */
+
+int ltm_queue_take(struct ltm_queue *q, struct ltm_update *update)
+{
+  struct ltm_queue_slot *slot = &q->slots[q->tail & (LTM_QUEUE_SIZE - 1)];
+  size_t seq;
+
+  seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if (seq != q->tail + 1) {
+    return 0;
+  }
+
+  *update = slot->update;
+  atomic_store_explicit(&slot->seq, q->tail + LTM_QUEUE_SIZE,
+                        memory_order_release);
+  q->tail++;
+  return 1;
+}
+
+/* Apply an update to a frame. */
+
+void ltm_apply_update(const struct ltm_update *update, uint8_t block[5][5])
+{
+  char text[LTM_ALPHANUM_LEN + 1];
+  int i, j;
+
+  switch (update->type) {
+  case LTM_UPDATE_FIELD:
+    memcpy(text, update->data.text, sizeof(text));
+    text[LTM_ALPHANUM_LEN] = '\0';
+    if (update->field == LTM_FIELD_NUMERIC) {
+      ltm_render_numeric(text, block);
+    } else {
+      ltm_render_alphanum(text, block);
+    }
+    break;
+
+  case LTM_UPDATE_FRAME:
+    memcpy(block, update->data.frame, sizeof(update->data.frame));
+    break;
+
+  case LTM_UPDATE_SET_MASK:
+  case LTM_UPDATE_CLEAR_MASK:
+    for (i = 0; i < 5; i++) {
+      for (j = 0; j < 4; j++) {
+        if (update->type == LTM_UPDATE_SET_MASK) {
+          block[i][j] = block[i][j] | update->data.frame[i][j];
+        } else {
+          block[i][j] = block[i][j] & ~update->data.frame[i][j];
+        }
+      }
+    }
+    break;
+  }
+
+  ltm_select_groups(block);
+}
@@ -0,0 +1,558 @@
+/*
+ * ltm_refresh.c -- refresh engine for the LTM-Y2K19JF-03 display.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * The display can only light one of its five segment groups at a
+ * time, so something has to keep cycling through them.  This code
+ * keeps track of which group is next and how long it should stay
+ * lit; the caller decides how to wait between steps.
+ *
+ * It also keeps an estimate of the LED drive load.  Each lit segment
+ * draws a fixed current while its group is selected, and each group
+ * is selected for a fifth of the time, so the average load is the
+ * sum of the lit segments in each group times the segment current,
+ * divided by five.  Dense frames (a row of "8"s, say) can draw more
+ * than a weak supply can give, so a cap can be set.  When the
+ * estimate is over the cap, each group is blanked partway through
+ * its period, cutting the duty cycle (and the brightness) just enough
+ * to stay under it.
+ *
+ * A sequence of frames (a transition, say) can also be queued up.
+ * Each one is shown for its number of cycles, swapped in only at the
+ * end of a full pass through the groups, and then the engine settles
+ * on the target frame.
+ *
+ * With the ltmy2k kernel module loaded, the kernel does the group
+ * cycling itself, and the engine just writes each new frame to its
+ * device.  Only transitions need any timing from us then.
+ *
+ * The engine can be stepped by hand from an existing event loop, or
+ * run in a thread of its own with ltm_refresh_start().  In the
+ * latter case, anything else touching the engine has to hold its
+ * lock (ltm_refresh_lock() and ltm_refresh_unlock()), or post its
+ * changes to an update queue (see ltm_queue.c) attached with
+ * ltm_refresh_set_queue().  The queue is drained at cycle
+ * boundaries, a batch at a time.  The thread
+ * keeps track of how late it wakes up for each step and how much CPU
+ * it uses, so the timing can be checked on new boards; if asked, it
+ * also counts what each step costs with the performance counters in
+ * ltm_perf.c.  With park_when_blank set, the thread stops stepping
+ * altogether while the frame is blank, and sleeps until it changes.
+ *
+ * To refresh many modules, their engines can instead share the
+ * threads of a runner (see ltm_runner.c).  Either way, steps that
+ * start more than LTM_REFRESH_SLACK_US late count as missed
+ * deadlines.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "ltmy2k19jf03.h"
+#include "ltm_refresh.h"
+#include "ltm_runner.h"
+
+/* Work out how long each group should stay lit for the current frame
+   and power cap. */
+
+static void update_power(struct ltm_refresh *r)
+{
+  long lit_total = 0;
+  int i;
+
+  for (i = 0; i < 5; i++) {
+    r->stats.lit_segments[i] = ltm_count_lit_segments(r->frame[i]);
+    lit_total += r->stats.lit_segments[i];
+  }
+
+  r->stats.load_ma = lit_total * r->segment_ma / 5;
+  r->on_us = r->period_us;
+
+  if ((r->power_cap_ma > 0) && (r->stats.load_ma > r->power_cap_ma)) {
+    r->on_us = r->period_us * r->power_cap_ma / r->stats.load_ma;
+    if (r->on_us < LTM_REFRESH_MIN_ON_US) {
+      r->on_us = LTM_REFRESH_MIN_ON_US;
+    }
+  }
+
+  r->stats.duty_permille = r->on_us * 1000 / r->period_us;
+  r->stats.capped_load_ma = r->stats.load_ma * r->on_us / r->period_us;
+}
+
+/* Set up a refresh engine with a blank frame. */
+
+void ltm_refresh_init(struct ltm_refresh *r, long period_us)
+{
+  uint8_t blank[5][5];
+  pthread_mutexattr_t lock_attr;
+  pthread_condattr_t wake_attr;
+
+  memset(r, 0, sizeof(struct ltm_refresh));
+  r->period_us = period_us;
+  r->segment_ma = LTM_SEGMENT_MA;
+  r->device_fd = -1;
+  ltm_perf_init(&r->perf);
+
+  /* The refresh thread usually runs at real-time priority, so make
+     sure whoever holds the lock gets boosted while they do. */
+
+  pthread_mutexattr_init(&lock_attr);
+  pthread_mutexattr_setprotocol(&lock_attr, PTHREAD_PRIO_INHERIT);
+  pthread_mutex_init(&r->lock, &lock_attr);
+  pthread_mutexattr_destroy(&lock_attr);
+
+  pthread_condattr_init(&wake_attr);
+  pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&r->wake, &wake_attr);
+  pthread_condattr_destroy(&wake_attr);
+  pthread_cond_init(&r->stepped, NULL);
+
+  memset(blank, 0, sizeof(blank));
+  ltm_select_groups(blank);
+  ltm_refresh_set_frame(r, blank);
+}
+
+/* Set the per-segment current and the average current cap, both in
+   milliamps.  A cap of 0 turns the limiter off. */
+
+void ltm_refresh_set_power_cap(struct ltm_refresh *r, long segment_ma,
+                               long cap_ma)
+{
+  r->segment_ma = segment_ma;
+  r->power_cap_ma = cap_ma;
+  update_power(r);
+}
+
+/* Replace the frame being shown.  It takes effect with the next
+   group written, and cuts short any sequence being played. */
+
+void ltm_refresh_set_frame(struct ltm_refresh *r, const uint8_t frame[5][5])
+{
+  memcpy(r->target, frame, sizeof(r->target));
+  memcpy(r->frame, frame, sizeof(r->frame));
+  r->sequence_len = 0;
+  update_power(r);
+}
+
+/* Play a sequence of frames, starting with the next full cycle, and
+   then show the target frame. */
+
+void ltm_refresh_play(struct ltm_refresh *r, const struct ltm_frame *frames,
+                      int nframes, const uint8_t target[5][5])
+{
+  if (nframes > LTM_TRANSITION_MAX_FRAMES) {
+    nframes = LTM_TRANSITION_MAX_FRAMES;
+  }
+
+  memcpy(r->target, target, sizeof(r->target));
+  memcpy(r->sequence, frames, nframes * sizeof(struct ltm_frame));
+  r->sequence_len = nframes;
+  r->sequence_pos = -1;
+  r->sequence_cycles = 0;
+}
+
+/* At the end of a cycle, move on to the next frame of the sequence,
+   if one is playing. */
+
+static void advance_sequence(struct ltm_refresh *r)
+{
+  if (r->sequence_len == 0) {
+    return;
+  }
+
+  if (--r->sequence_cycles > 0) {
+    return;
+  }
+
+  r->sequence_pos++;
+  if (r->sequence_pos >= r->sequence_len) {
+    memcpy(r->frame, r->target, sizeof(r->frame));
+    r->sequence_len = 0;
+  } else {
+    memcpy(r->frame, r->sequence[r->sequence_pos].block, sizeof(r->frame));
+    r->sequence_cycles = r->sequence[r->sequence_pos].cycles;
+  }
+
+  update_power(r);
+}
+
+/* Take updates from an attached queue, as well as from
+   ltm_refresh_set_frame(). */
+
+void ltm_refresh_set_queue(struct ltm_refresh *r, struct ltm_queue *q)
+{
+  r->queue = q;
+}
+
+/* At the end of a cycle, apply a batch of queued updates on top of
+   the frame we're settling on.  Like ltm_refresh_set_frame(), this
+   cuts short any sequence being played. */
+
+static void drain_queue(struct ltm_refresh *r)
+{
+  struct ltm_update update;
+  uint8_t block[5][5];
+  int n = 0;
+
+  if (r->queue == NULL) {
+    return;
+  }
+
+  memcpy(block, r->target, sizeof(block));
+  while ((n < LTM_QUEUE_BATCH) && ltm_queue_take(r->queue, &update)) {
+    ltm_apply_update(&update, block);
+    n++;
+  }
+
+  if (n > 0) {
+    r->stats.queue_updates += n;
+    ltm_refresh_set_frame(r, block);
+  }
+}
+
+/* Drive the display module on the given pins, rather than the
+   library's default display. */
+
+void ltm_refresh_set_display(struct ltm_refresh *r, struct ltm_display *d)
+{
+  r->display = d;
+}
+
+static void send_group(struct ltm_refresh *r, const uint8_t group[5])
+{
+  if (r->display != NULL) {
+    ltm_display_blast_block(r->display, group);
+  } else {
+    ltm_blast_block(group);
+  }
+}
+
+/* Hand the group cycling over to the ltmy2k kernel module, whose
+   device is open on fd. */
+
+void ltm_refresh_set_device(struct ltm_refresh *r, int fd)
+{
+  r->device_fd = fd;
+  memset(r->written, 0, sizeof(r->written));
+}
+
+/* With the kernel module, write the frame if it changed, and only ask
+   to be called back while a sequence is playing or a failed write
+   needs another try. */
+
+static long step_device(struct ltm_refresh *r)
+{
+  ssize_t retval;
+
+  drain_queue(r);
+  if (r->sequence_len > 0) {
+    r->stats.cycles++;
+    advance_sequence(r);
+  }
+
+  if (memcmp(r->written, r->frame, sizeof(r->frame)) != 0) {
+    retval = write(r->device_fd, r->frame, sizeof(r->frame));
+    if (retval == sizeof(r->frame)) {
+      memcpy(r->written, r->frame, sizeof(r->written));
+    } else {
+      r->stats.write_errors++;
+      r->stats.write_errno = (retval < 0) ? errno : EIO;
+    }
+  }
+
+  /* Keep trying a frame that didn't get written; otherwise, it would
+     stay off the display until the next change. */
+
+  if (r->sequence_len > 0) {
+    return r->period_us * 5;
+  }
+  if (memcmp(r->written, r->frame, sizeof(r->frame)) != 0) {
+    return LTM_REFRESH_DEVICE_RETRY_US;
+  }
+  return -1;
+}
+
+/* Do the next bit of refresh work: either light the next group, or,
+   if the power cap is cutting the dwell short, turn the current group
+   off.  Returns the number of microseconds to wait before the next
+   step, or -1 if there's nothing to do until the frame changes. */
+
+long ltm_refresh_step(struct ltm_refresh *r)
+{
+  static const uint8_t blank_group[5] = { 0, 0, 0, 0, 0 };
+
+  if (r->device_fd >= 0) {
+    return step_device(r);
+  }
+
+  if (r->lit && (r->on_us < r->period_us)) {
+    send_group(r, blank_group);
+    r->lit = 0;
+    return r->period_us - r->on_us;
+  }
+
+  send_group(r, r->frame[r->group]);
+  r->lit = 1;
+
+  r->group++;
+  if (r->group >= 5) {
+    r->group = 0;
+    r->stats.cycles++;
+    advance_sequence(r);
+    drain_queue(r);
+  }
+
+  return r->on_us;
+}
+
+/* Helpers for the refresh thread's timekeeping. */
+
+static void add_us(struct timespec *ts, long us)
+{
+  ts->tv_sec += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static long diff_us(const struct timespec *later,
+                    const struct timespec *earlier)
+{
+  return (later->tv_sec - earlier->tv_sec) * 1000000L +
+    (later->tv_nsec - earlier->tv_nsec) / 1000;
+}
+
+static int frame_is_blank(const struct ltm_refresh *r)
+{
+  int i;
+
+  for (i = 0; i < 5; i++) {
+    if (r->stats.lit_segments[i] != 0) {
+      return 0;
+    }
+  }
+
+  return r->sequence_len == 0;
+}
+
+/* Take a step for whatever is scheduling the engine (its own thread
+   or a runner), with the lock held, and keep the timing stats.
+   late_us is how late the step started.  Returns the microseconds
+   until the next step.  If there's nothing to refresh, *idle is set,
+   and the time is how long to wait before looking at the queue
+   again, or -1 to wait until the engine is changed.  That includes a
+   blank frame, if we're allowed to park on one; the step just taken
+   has already turned the display off. */
+
+long ltm_refresh_scheduled_step(struct ltm_refresh *r, long late_us,
+                                int *idle)
+{
+  struct timespec now;
+  long wait_us;
+
+  if (late_us > 0) {
+    r->stats.late_total_us += late_us;
+    r->stats.late_squares_us2 += (double)late_us * late_us;
+    if (late_us > r->stats.late_max_us) {
+      r->stats.late_max_us = late_us;
+    }
+    if (late_us > LTM_REFRESH_SLACK_US) {
+      r->stats.deadline_misses++;
+    }
+    if (late_us > r->period_us) {
+      r->stats.overruns++;
+    }
+  }
+
+  ltm_perf_begin(&r->perf);
+  wait_us = ltm_refresh_step(r);
+  ltm_perf_end(&r->perf);
+  r->stats.steps++;
+
+  if (r->stats.steps == 1) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    r->stats.first_step_us = diff_us(&now, &r->started);
+    pthread_cond_broadcast(&r->stepped);
+  }
+
+  /* Posting to the queue doesn't wake anyone, so with one attached,
+     look at it again after a cycle's time. */
+
+  *idle = (wait_us < 0) || (r->park_when_blank && frame_is_blank(r));
+  if (*idle) {
+    if (r->queue != NULL) {
+      return r->period_us * 5;
+    }
+    r->stats.parks++;
+    return -1;
+  }
+
+  return wait_us;
+}
+
+/* Wait, with the lock held, until someone changes the engine or the
+   deadline passes (or forever, if deadline is NULL).  Returns 1 if
+   we were woken up early. */
+
+static int wait_for_kick(struct ltm_refresh *r, const struct timespec *deadline)
+{
+  int retval = 0;
+
+  r->kicked = 0;
+  while (!r->kicked && r->running && (retval != ETIMEDOUT)) {
+    if (deadline == NULL) {
+      pthread_cond_wait(&r->wake, &r->lock);
+    } else {
+      retval = pthread_cond_timedwait(&r->wake, &r->lock, deadline);
+    }
+  }
+
+  return r->kicked;
+}
+
+/* Main loop for the refresh thread.  Each step is scheduled against
+   an absolute deadline, so the rate doesn't drift with the time the
+   step itself takes; if we fall more than a whole period behind, we
+   start counting from now again. */
+
+static void *refresh_thread(void *arg)
+{
+  struct ltm_refresh *r = arg;
+  struct timespec deadline, now, cpu;
+  long wait_us, late_us = 0;
+  int idle;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  pthread_mutex_lock(&r->lock);
+  if (r->perf_enabled) {
+    ltm_perf_open(&r->perf);
+  }
+
+  while (r->running) {
+    wait_us = ltm_refresh_scheduled_step(r, late_us, &idle);
+
+    if (r->group == 0) {
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+      r->stats.cpu_us = cpu.tv_sec * 1000000LL + cpu.tv_nsec / 1000;
+    }
+
+    /* Nothing to refresh: sleep until there's something new. */
+
+    if (idle) {
+      if (wait_us < 0) {
+        wait_for_kick(r, NULL);
+      } else {
+        add_us(&deadline, wait_us);
+        wait_for_kick(r, &deadline);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      late_us = 0;
+      continue;
+    }
+
+    add_us(&deadline, wait_us);
+
+    pthread_mutex_unlock(&r->lock);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                           NULL) == EINTR) {
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&r->lock);
+
+    late_us = diff_us(&now, &deadline);
+    if (late_us > r->period_us) {
+      deadline = now;
+    }
+  }
+  ltm_perf_close(&r->perf);
+  pthread_mutex_unlock(&r->lock);
+
+  return NULL;
+}
+
+/* Start refreshing from a thread of our own.  If priority is more
+   than 0, the thread runs with that SCHED_FIFO priority.  Returns 0,
+   or an error number if the thread couldn't be started. */
+
+int ltm_refresh_start(struct ltm_refresh *r, int priority)
+{
+  pthread_attr_t attr;
+  struct sched_param sched_p;
+  int retval;
+
+  pthread_attr_init(&attr);
+  if (priority > 0) {
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    sched_p.sched_priority = priority;
+    pthread_attr_setschedparam(&attr, &sched_p);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &r->started);
+  r->running = 1;
+  retval = pthread_create(&r->thread, &attr, refresh_thread, r);
+  if (retval != 0) {
+    r->running = 0;
+  }
+
+  pthread_attr_destroy(&attr);
+  return retval;
+}
+
+/* Stop the refresh thread and wait for it to finish. */
+
+void ltm_refresh_stop(struct ltm_refresh *r)
+{
+  pthread_mutex_lock(&r->lock);
+  r->running = 0;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+
+  pthread_join(r->thread, NULL);
+}
+
+/* Have the refresh thread count cycles, instructions, context
+   switches and page faults for each step, as far as the system
+   allows.  Call before ltm_refresh_start(). */
+
+void ltm_refresh_enable_perf(struct ltm_refresh *r)
+{
+  r->perf_enabled = 1;
+}
+
+/* Wait until the refresh thread has put out its first step (or has
+   been stopped). */
+
+void ltm_refresh_wait_first_step(struct ltm_refresh *r)
+{
+  pthread_mutex_lock(&r->lock);
+  while ((r->stats.steps == 0) && r->running) {
+    pthread_cond_wait(&r->stepped, &r->lock);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* Take and release the engine's lock.  Releasing it also wakes the
+   refresh thread (or the engine's runner) if it's sleeping, in case
+   something changed. */
+
+void ltm_refresh_lock(struct ltm_refresh *r)
+{
+  pthread_mutex_lock(&r->lock);
+}
+
+void ltm_refresh_unlock(struct ltm_refresh *r)
+{
+  r->kicked = 1;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+
+  if (r->runner != NULL) {
+    ltm_runner_kick(r->runner, r);
+  }
+}
@@ -0,0 +1,305 @@
+/*
+ * ltm_runner.c -- shared refresh threads for many display modules.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * Each refresh step spends its time busy-waiting on the bits going
+ * out to the module, so one thread can only keep a few modules lit
+ * before their steps start running into each other.  A runner
+ * spreads the engines for a whole panel over a few real-time
+ * threads, each pinned to a different core.
+ *
+ * The threads share one list of engines, each with the time its next
+ * step is due.  Whichever thread is free takes the engine that's due
+ * soonest (and not already being stepped), so the work follows the
+ * deadlines rather than a fixed split: a thread held up by a slow
+ * module just leaves its other modules to the rest.  An engine only
+ * ever runs on one thread at a time, under its own lock, so its
+ * groups still go out in order.
+ *
+ * Idle engines (nothing to refresh) are left out until they're
+ * changed; ltm_refresh_unlock() kicks the runner for that.  Per-step
+ * performance counting isn't done for engines on a runner, since
+ * the counters belong to threads, not engines.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "ltm_runner.h"
+
+/* Helpers for timekeeping. */
+
+static void add_us(struct timespec *ts, long us)
+{
+  ts->tv_sec += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static long diff_us(const struct timespec *later,
+                    const struct timespec *earlier)
+{
+  return (later->tv_sec - earlier->tv_sec) * 1000000L +
+    (later->tv_nsec - earlier->tv_nsec) / 1000;
+}
+
+/* Set up an empty runner. */
+
+void ltm_runner_init(struct ltm_runner *run)
+{
+  pthread_mutexattr_t lock_attr;
+  pthread_condattr_t wake_attr;
+
+  memset(run, 0, sizeof(struct ltm_runner));
+
+  pthread_mutexattr_init(&lock_attr);
+  pthread_mutexattr_setprotocol(&lock_attr, PTHREAD_PRIO_INHERIT);
+  pthread_mutex_init(&run->lock, &lock_attr);
+  pthread_mutexattr_destroy(&lock_attr);
+
+  pthread_condattr_init(&wake_attr);
+  pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&run->wake, &wake_attr);
+  pthread_condattr_destroy(&wake_attr);
+}
+
+/* Have the runner refresh an engine, instead of the engine's own
+   thread.  Call before ltm_runner_start().  Returns 0, or -1 if the
+   runner is full. */
+
+int ltm_runner_add(struct ltm_runner *run, struct ltm_refresh *r)
+{
+  struct ltm_runner_slot *slot;
+
+  if (run->nengines >= LTM_RUNNER_MAX_ENGINES) {
+    return -1;
+  }
+
+  slot = &run->slots[run->nengines];
+  memset(slot, 0, sizeof(struct ltm_runner_slot));
+  slot->engine = r;
+  r->runner = run;
+  r->runner_slot = run->nengines;
+  run->nengines++;
+
+  return 0;
+}
+
+/* The engine that should be stepped next, or NULL if every one is
+   parked or being stepped already.  Call with the runner locked. */
+
+static struct ltm_runner_slot *earliest_slot(struct ltm_runner *run)
+{
+  struct ltm_runner_slot *slot, *best = NULL;
+  int i;
+
+  for (i = 0; i < run->nengines; i++) {
+    slot = &run->slots[i];
+    if (slot->busy || slot->parked) {
+      continue;
+    }
+    if ((best == NULL) || (diff_us(&slot->due, &best->due) < 0)) {
+      best = slot;
+    }
+  }
+
+  return best;
+}
+
+/* Main loop for each of the runner's threads.  Steps are scheduled
+   against absolute due times, as in the engine's own thread; an
+   engine that falls more than a whole period behind starts counting
+   from now again. */
+
+static void *runner_thread(void *arg)
+{
+  struct ltm_runner *run = arg;
+  struct ltm_runner_slot *slot;
+  struct ltm_refresh *r;
+  struct timespec now, cpu_before, cpu_after;
+  long wait_us, late_us;
+  int was_idle, idle;
+
+  pthread_mutex_lock(&run->lock);
+  while (run->running) {
+    slot = earliest_slot(run);
+    if (slot == NULL) {
+      pthread_cond_wait(&run->wake, &run->lock);
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late_us = diff_us(&now, &slot->due);
+    if (late_us < 0) {
+      pthread_cond_timedwait(&run->wake, &run->lock, &slot->due);
+      continue;
+    }
+
+    slot->busy = 1;
+    was_idle = slot->idle;
+    r = slot->engine;
+    pthread_mutex_unlock(&run->lock);
+
+    pthread_mutex_lock(&r->lock);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_before);
+    wait_us = ltm_refresh_scheduled_step(r, was_idle ? 0 : late_us, &idle);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_after);
+    r->stats.cpu_us += diff_us(&cpu_after, &cpu_before);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* Work out when it's due again before letting go of the engine,
+       so a change made right after this can't miss it parking. */
+
+    pthread_mutex_lock(&run->lock);
+    slot->busy = 0;
+    slot->idle = idle;
+    slot->parked = idle && (wait_us < 0);
+    if (!slot->parked) {
+      if (idle || (late_us > r->period_us)) {
+        slot->due = now;
+      }
+      add_us(&slot->due, wait_us);
+    }
+    pthread_cond_broadcast(&run->wake);
+    pthread_mutex_unlock(&r->lock);
+  }
+  pthread_mutex_unlock(&run->lock);
+
+  return NULL;
+}
+
+#ifdef __linux__
+
+/* Pin a thread to the nth of the CPUs we're allowed to use, wrapping
+   around if there are more threads than CPUs. */
+
+static void pin_thread(pthread_attr_t *attr, int n)
+{
+  cpu_set_t allowed, cpus;
+  int cpu;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return;
+  }
+
+  n = n % CPU_COUNT(&allowed);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && (n-- == 0)) {
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+      return;
+    }
+  }
+}
+
+#else
+
+static void pin_thread(pthread_attr_t *attr, int n)
+{
+}
+
+#endif
+
+/* Start nthreads threads refreshing the runner's engines, each on a
+   core of its own as far as there are enough.  If priority is more
+   than 0, they run with that SCHED_FIFO priority.  Returns 0, or an
+   error number if the threads couldn't be started (in which case
+   none are left running). */
+
+int ltm_runner_start(struct ltm_runner *run, int nthreads, int priority)
+{
+  pthread_attr_t attr;
+  struct sched_param sched_p;
+  struct ltm_refresh *r;
+  int retval = 0;
+  int i;
+
+  if (nthreads > LTM_RUNNER_MAX_THREADS) {
+    nthreads = LTM_RUNNER_MAX_THREADS;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+
+  for (i = 0; i < run->nengines; i++) {
+    r = run->slots[i].engine;
+    clock_gettime(CLOCK_MONOTONIC, &r->started);
+    run->slots[i].due = r->started;
+    r->running = 1;
+  }
+
+  run->running = 1;
+  for (i = 0; i < nthreads; i++) {
+    pthread_attr_init(&attr);
+    if (priority > 0) {
+      pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+      sched_p.sched_priority = priority;
+      pthread_attr_setschedparam(&attr, &sched_p);
+    }
+    pin_thread(&attr, i);
+
+    retval = pthread_create(&run->threads[i], &attr, runner_thread, run);
+    pthread_attr_destroy(&attr);
+    if (retval != 0) {
+      break;
+    }
+    run->nthreads++;
+  }
+
+  if (retval != 0) {
+    ltm_runner_stop(run);
+  }
+  return retval;
+}
+
+/* Stop the runner's threads and wait for them to finish. */
+
+void ltm_runner_stop(struct ltm_runner *run)
+{
+  struct ltm_refresh *r;
+  int i;
+
+  for (i = 0; i < run->nengines; i++) {
+    r = run->slots[i].engine;
+    pthread_mutex_lock(&r->lock);
+    r->running = 0;
+    pthread_cond_broadcast(&r->stepped);
+    pthread_mutex_unlock(&r->lock);
+  }
+
+  pthread_mutex_lock(&run->lock);
+  run->running = 0;
+  pthread_cond_broadcast(&run->wake);
+  pthread_mutex_unlock(&run->lock);
+
+  for (i = 0; i < run->nthreads; i++) {
+    pthread_join(run->threads[i], NULL);
+  }
+  run->nthreads = 0;
+}
+
+/* Let the runner know an engine has changed, so an idle one gets
+   stepped again right away.  Call without the engine's lock held. */
+
+void ltm_runner_kick(struct ltm_runner *run, struct ltm_refresh *r)
+{
+  struct ltm_runner_slot *slot = &run->slots[r->runner_slot];
+
+  pthread_mutex_lock(&run->lock);
+  if (slot->idle && !slot->busy) {
+    clock_gettime(CLOCK_MONOTONIC, &slot->due);
+    slot->idle = 0;
+    slot->parked = 0;
+    pthread_cond_broadcast(&run->wake);
+  }
+  pthread_mutex_unlock(&run->lock);
+}
@@ -0,0 +1,249 @@
+/*
+ * ltm_transition.c -- transition effects for the LTM-Y2K19JF-03
+ *                     display.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * When a field changes, we can play a short animation between the
+ * old and new contents instead of just switching.  All of the frames
+ * are worked out up front from the old and new blocks, so the refresh
+ * engine only has to copy the next one in at the end of each cycle.
+ *
+ * The effects are:
+ *
+ * WIPE   the new characters replace the old ones left to right.
+ * BUILD  the field is cleared, then the new segments light a few at
+ *        a time.
+ * SLIDE  the old text scrolls off to the left as the new text comes
+ *        in from the right.
+ * FADE   a cross-fade; each cycle shows either the old or the new
+ *        field, with the new one shown more and more often.
+ *
+ * Only the field that changed is animated; everything else in each
+ * frame comes from the new block.
+ */
+
+#include <string.h>
+
+#include "ltmy2k19jf03.h"
+#include "ltm_transition.h"
+
+static const char *transition_names[] =
+  { "NONE", "WIPE", "BUILD", "SLIDE", "FADE", NULL };
+
+/* Look up an effect by name.  Returns -1 if there's no such
+   effect. */
+
+int ltm_transition_find(const char *name)
+{
+  int i;
+
+  for (i = 0; transition_names[i] != NULL; i++) {
+    if (strcmp(transition_names[i], name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Helpers for treating both fields the same way. */
+
+static int field_len(int field)
+{
+  return (field == LTM_FIELD_ALPHANUM) ? LTM_ALPHANUM_LEN : LTM_NUMERIC_LEN;
+}
+
+static uint16_t get_code(int field, int pos, const uint8_t block[5][5])
+{
+  if (field == LTM_FIELD_ALPHANUM) {
+    return ltm_get_alphanum_code(pos, block);
+  }
+  return ltm_get_numeric_code(pos, block);
+}
+
+static void set_code(int field, int pos, uint16_t code, uint8_t block[5][5])
+{
+  if (field == LTM_FIELD_ALPHANUM) {
+    ltm_set_alphanum_code(pos, code, block);
+  } else {
+    ltm_set_numeric_code(pos, (uint8_t)code, block);
+  }
+}
+
+/* Start a frame as a copy of the new block with the field blanked. */
+
+static void start_frame(int field, const uint8_t to[5][5], int cycles,
+                        struct ltm_frame *frame)
+{
+  memcpy(frame->block, to, sizeof(frame->block));
+  if (field == LTM_FIELD_ALPHANUM) {
+    ltm_clear_alphanum(frame->block);
+  } else {
+    ltm_clear_numeric(frame->block);
+  }
+  frame->cycles = cycles;
+}
+
+static int count_bits(uint16_t code)
+{
+  int count = 0;
+
+  while (code != 0) {
+    code = code & (code - 1);
+    count++;
+  }
+
+  return count;
+}
+
+static int build_wipe(int field, const uint8_t from[5][5],
+                      const uint8_t to[5][5], int hold,
+                      struct ltm_frame *frames)
+{
+  int len = field_len(field);
+  int i, pos;
+
+  for (i = 0; i < len; i++) {
+    start_frame(field, to, hold, &frames[i]);
+    for (pos = 0; pos < len; pos++) {
+      set_code(field, pos, get_code(field, pos, (pos <= i) ? to : from),
+               frames[i].block);
+    }
+  }
+
+  return len;
+}
+
+static int build_slide(int field, const uint8_t from[5][5],
+                       const uint8_t to[5][5], int hold,
+                       struct ltm_frame *frames)
+{
+  int len = field_len(field);
+  int i, pos, src;
+
+  for (i = 0; i < len; i++) {
+    start_frame(field, to, hold, &frames[i]);
+    for (pos = 0; pos < len; pos++) {
+      src = pos + i + 1;
+      if (src < len) {
+        set_code(field, pos, get_code(field, src, from), frames[i].block);
+      } else {
+        set_code(field, pos, get_code(field, src - len, to),
+                 frames[i].block);
+      }
+    }
+  }
+
+  return len;
+}
+
+static int build_segments(int field, const uint8_t to[5][5], int cycles,
+                          struct ltm_frame *frames)
+{
+  int len = field_len(field);
+  int total = 0;
+  int nframes, i, pos, lit, target;
+  uint16_t code, bit;
+
+  for (pos = 0; pos < len; pos++) {
+    total += count_bits(get_code(field, pos, to));
+  }
+
+  nframes = cycles;
+  if (nframes > total) {
+    nframes = total;
+  }
+  if (nframes > LTM_TRANSITION_MAX_FRAMES) {
+    nframes = LTM_TRANSITION_MAX_FRAMES;
+  }
+
+  /* Frame i lights the first (i + 1) / nframes of the segments,
+     working through the positions in order. */
+
+  for (i = 0; i < nframes; i++) {
+    start_frame(field, to, 1, &frames[i]);
+    target = total * (i + 1) / nframes;
+    lit = 0;
+    for (pos = 0; pos < len && lit < target; pos++) {
+      code = get_code(field, pos, to);
+      for (bit = 0x8000; bit != 0 && lit < target; bit = bit >> 1) {
+        if (code & bit) {
+          set_code(field, pos, bit, frames[i].block);
+          lit++;
+        }
+      }
+    }
+  }
+
+  return nframes;
+}
+
+static int build_fade(int field, const uint8_t from[5][5],
+                      const uint8_t to[5][5], int cycles,
+                      struct ltm_frame *frames)
+{
+  int len = field_len(field);
+  int nframes, i, pos, shown;
+  const uint8_t (*src)[5];
+
+  nframes = cycles;
+  if (nframes > LTM_TRANSITION_MAX_FRAMES) {
+    nframes = LTM_TRANSITION_MAX_FRAMES;
+  }
+
+  /* Dither between the two, so the share of frames showing the new
+     field grows steadily from none to all: frame i counts for
+     (i + 1) / (n + 1) of a new frame, and we show the new field
+     whenever the running total gets half a frame ahead of what's
+     been shown. */
+
+  shown = 0;
+  for (i = 0; i < nframes; i++) {
+    start_frame(field, to, 1, &frames[i]);
+    if ((2 * shown + 1) * (nframes + 1) < (i + 1) * (i + 2)) {
+      src = to;
+      shown++;
+    } else {
+      src = from;
+    }
+    for (pos = 0; pos < len; pos++) {
+      set_code(field, pos, get_code(field, pos, src), frames[i].block);
+    }
+  }
+
+  return nframes;
+}
+
+/* Fill in the frames for a transition on one field, taking about
+   "cycles" refresh cycles in all.  Returns the number of frames, or
+   0 if there's nothing to play. */
+
+int ltm_transition_build(int effect, int field,
+                         const uint8_t from[5][5], const uint8_t to[5][5],
+                         int cycles, struct ltm_frame *frames)
+{
+  int hold;
+
+  if (cycles < 1) {
+    return 0;
+  }
+
+  hold = cycles / field_len(field);
+  if (hold < 1) {
+    hold = 1;
+  }
+
+  switch (effect) {
+  case LTM_TRANSITION_WIPE:
+    return build_wipe(field, from, to, hold, frames);
+  case LTM_TRANSITION_BUILD:
+    return build_segments(field, to, cycles, frames);
+  case LTM_TRANSITION_SLIDE:
+    return build_slide(field, from, to, hold, frames);
+  case LTM_TRANSITION_FADE:
+    return build_fade(field, from, to, cycles, frames);
+  }
+
+  return 0;
+}
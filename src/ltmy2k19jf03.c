@@ -58,6 +58,11 @@
  * of time for extra resync zero bits, and also not tax the processor
  * too heavily.
  *
+ * Several modules can be driven at once, each on its own pins, by
+ * keeping a struct ltm_display for each and using the ltm_display_*
+ * calls.  The older calls without one work on a single default
+ * display.
+ *
  * This routine is written assuming the pins are connected to a
  * Raspberry Pi Model B, with the data pin hooked to GPIO 22, the
  * clock pin hooked to GPIO 17, and the reset pin hooked to GPIO 21/27
@@ -68,22 +73,23 @@
 
 #include <stdio.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 
 #include "ltmy2k19jf03.h"
 #include "gpio.h"
 
-/* Globals for tracking pin state. */
+/* The display used by the calls that don't take one. */
 
-int ltm_data_pin = 0;
-int ltm_clock_pin = 0;
-int ltm_reset_pin = 0;
+static struct ltm_display default_display;
 
 /* For the 14-bit alphanumberic setups, create bit patterns for common
    characters to display. */
 
 const uint16_t alphanum_chars[][2] = {
   { ' ', 0x0000 },
+  { '-', 0x0088 },
+  { '+', 0x02A8 },
   { 'A', 0xEC88 },
   { 'B', 0xF2A0 },
   { 'C', 0x9C00 },
@@ -123,9 +129,10 @@ const uint16_t alphanum_chars[][2] = {
   { 0, 0 }
 };
 
-/* Do any setup needed to use the display. */
+/* Do any setup needed to use a display on the given pins. */
 
-int ltm_display_init(int data_pin, int clock_pin, int reset_pin)
+int ltm_display_open(struct ltm_display *d, int data_pin, int clock_pin,
+                     int reset_pin)
 {
   gpio_export_pin(data_pin);
   gpio_set_direction(data_pin, GPIO_DIR_OUTPUT);
@@ -134,35 +141,51 @@ int ltm_display_init(int data_pin, int clock_pin, int reset_pin)
   gpio_export_pin(reset_pin);
   gpio_set_direction(reset_pin, GPIO_DIR_OUTPUT);
 
-  ltm_data_pin = data_pin;
-  ltm_clock_pin = clock_pin;
-  ltm_reset_pin = reset_pin;
+  d->data_pin = data_pin;
+  d->clock_pin = clock_pin;
+  d->reset_pin = reset_pin;
 
   return 0;
 }
 
-/* Shut down the display. */
+int ltm_display_init(int data_pin, int clock_pin, int reset_pin)
+{
+  return ltm_display_open(&default_display, data_pin, clock_pin, reset_pin);
+}
 
 /* Clear the display. */
 
-int ltm_clear()
+int ltm_display_clear(struct ltm_display *d)
 {
-  gpio_write_pin(ltm_reset_pin, GPIO_PIN_HIGH);
+  gpio_write_pin(d->reset_pin, GPIO_PIN_HIGH);
   ltm_sleep(1);
-  gpio_write_pin(ltm_reset_pin, GPIO_PIN_LOW);
+  gpio_write_pin(d->reset_pin, GPIO_PIN_LOW);
+  return 0;
 }
 
-void ltm_display_shutdown()
+int ltm_clear()
+{
+  return ltm_display_clear(&default_display);
+}
+
+/* Shut down the display. */
+
+void ltm_display_close(struct ltm_display *d)
 {
   /* Reset the display. */
 
-  ltm_clear();
+  ltm_display_clear(d);
 
   /* Unregister the GPIO pins. */
 
-  gpio_unexport_pin(ltm_data_pin);
-  gpio_unexport_pin(ltm_clock_pin);
-  gpio_unexport_pin(ltm_reset_pin);
+  gpio_unexport_pin(d->data_pin);
+  gpio_unexport_pin(d->clock_pin);
+  gpio_unexport_pin(d->reset_pin);
+}
+
+void ltm_display_shutdown()
+{
+  ltm_display_close(&default_display);
 }
 
 /* Sleep for a specified number of microseconds.  For delays less
@@ -199,7 +222,7 @@ void ltm_sleep(long usec)
   } else {
     to_wait.tv_sec = usec / 1000000;
     remaining.tv_sec = 0;
-    to_wait.tv_nsec = usec % 1000000;
+    to_wait.tv_nsec = (usec % 1000000) * 1000;
     remaining.tv_nsec = 0;
     sleep_retval = -1;
     errno = EINTR;
@@ -215,26 +238,27 @@ void ltm_sleep(long usec)
    0 or 1.  It can be more than 1; we mask off all but the first bit
    for the sake of convenience. */
 
-void blast_bit(const uint8_t bit)
+static void blast_bit(struct ltm_display *d, const uint8_t bit)
 {
   int bit_setting =
     ((bit & 0x01) == 0) ? GPIO_PIN_LOW : GPIO_PIN_HIGH;
 
   /* Failsafe: make sure the clock pin starts low every time. */
 
-  gpio_write_pin(ltm_clock_pin, GPIO_PIN_LOW);
-  gpio_write_pin(ltm_data_pin, bit_setting);
+  gpio_write_pin(d->clock_pin, GPIO_PIN_LOW);
+  gpio_write_pin(d->data_pin, bit_setting);
 
   ltm_sleep(1);
-  gpio_write_pin(ltm_clock_pin, GPIO_PIN_HIGH);
+  gpio_write_pin(d->clock_pin, GPIO_PIN_HIGH);
 
   ltm_sleep(1);
-  gpio_write_pin(ltm_clock_pin, GPIO_PIN_LOW);
+  gpio_write_pin(d->clock_pin, GPIO_PIN_LOW);
 }
 
 /* Write an entire 34-byte block to the display controller. */
 
-void ltm_blast_block(const uint8_t render_block[5])
+void ltm_display_blast_block(struct ltm_display *d,
+                             const uint8_t render_block[5])
 {
   uint8_t local_block[5];
   int i, j;
@@ -250,15 +274,62 @@ void ltm_blast_block(const uint8_t render_block[5])
 
   /* Start bit. */
 
-  blast_bit(1);
+  blast_bit(d, 1);
 
   /* Now go through the entire block bit by bit. */
 
   for (i = 0; i < 5; i++) {
     for (j = 7; j >= 0; j--) {
-      blast_bit(local_block[i] >> j);
+      blast_bit(d, local_block[i] >> j);
+    }
+  }
+}
+
+void ltm_blast_block(const uint8_t render_block[5])
+{
+  ltm_display_blast_block(&default_display, render_block);
+}
+
+/* Set the group-select bits in each row of a frame, so each row
+   lights the right group of segments. */
+
+void ltm_select_groups(uint8_t block[5][5])
+{
+  int i;
+
+  for (i = 0; i < 5; i++) {
+    block[i][3] = block[i][3] & 0xF8;
+    block[i][4] = 0;
+  }
+
+  block[0][3] = block[0][3] | 0x04;
+  block[1][3] = block[1][3] | 0x02;
+  block[2][3] = block[2][3] | 0x01;
+  block[3][4] = 0x80;
+  block[4][4] = 0x40;
+}
+
+/* Count the segments a single group would light, not counting the
+   group-select bits. */
+
+int ltm_count_lit_segments(const uint8_t render_block[5])
+{
+  int count = 0;
+  int i;
+  uint8_t bits;
+
+  for (i = 0; i < 4; i++) {
+    bits = render_block[i];
+    if (i == 3) {
+      bits = bits & 0xF8;
+    }
+    while (bits != 0) {
+      bits = bits & (bits - 1);
+      count++;
     }
   }
+
+  return count;
 }
 
 /* For a given character, return the bit code to render the character
@@ -292,7 +363,7 @@ void ltm_clear_alphanum(uint8_t block[5][5])
 
   for (i = 0; i < 5; i++) {
     block[i][0] = 0;
-    block[i][1] = block[i][1] & 0x02;
+    block[i][1] = block[i][1] & 0x03;
   }
   for (i = 3; i < 5; i++) {
     block[i][1] = 0;
@@ -301,27 +372,50 @@ void ltm_clear_alphanum(uint8_t block[5][5])
   }
 }
 
+/* Light the segments in "code" at one of the alphanum positions.
+   Segments already lit there are left alone. */
+
+void ltm_set_alphanum_code(int pos, uint16_t code, uint8_t block[5][5])
+{
+  int j;
+
+  if (pos < 5) {
+    block[pos][0] = block[pos][0] | (uint8_t)((code & 0xFF00) >> 8);
+    block[pos][1] = block[pos][1] | (uint8_t)(code & 0x00FC);
+  } else {
+    j = pos - 2;
+    block[j][1] = block[j][1] | (uint8_t)((code & 0xC000) >> 14);
+    block[j][2] = block[j][2] | (uint8_t)((code & 0x3FC0) >> 6);
+    block[j][3] = block[j][3] | (uint8_t)((code & 0x003C) << 2);
+  }
+}
+
+/* Read back the segments lit at one of the alphanum positions. */
+
+uint16_t ltm_get_alphanum_code(int pos, const uint8_t block[5][5])
+{
+  int j;
+
+  if (pos < 5) {
+    return ((uint16_t)block[pos][0] << 8) | (block[pos][1] & 0xFC);
+  }
+
+  j = pos - 2;
+  return (((uint16_t)(block[j][1] & 0x03)) << 14) |
+    ((uint16_t)block[j][2] << 6) |
+    ((block[j][3] & 0xF0) >> 2);
+}
+
 /* Render the string into the alphanum section of the display. */
 
 void ltm_render_alphanum(const char *render, uint8_t block[5][5])
 {
-  int i, j;
-  uint16_t code;
+  int i;
 
   ltm_clear_alphanum(block);
 
-  for (i = 0; i < 7 && render[i] != '\0'; i++) {
-    code = ltm_find_alphanum_code(render[i]);
-
-    if (i < 5) {
-      block[i][0] = block[i][0] | (uint8_t)((code & 0xFF00) >> 8);
-      block[i][1] = block[i][1] | (uint8_t)(code & 0x00FC);
-    } else {
-      j = i - 2;
-      block[j][1] = block[j][1] | (uint8_t)((code & 0xC000) >> 14);
-      block[j][2] = block[j][2] | (uint8_t)((code & 0x3FC0) >> 6);
-      block[j][3] = block[j][3] | (uint8_t)((code & 0x003C) << 2);
-    }
+  for (i = 0; i < LTM_ALPHANUM_LEN && render[i] != '\0'; i++) {
+    ltm_set_alphanum_code(i, ltm_find_alphanum_code(render[i]), block);
   }
 }
 
@@ -333,6 +427,13 @@ uint8_t ltm_find_numeric_code(char c)
   uint8_t middle_seg = 0;
   uint16_t code = 0x03FC; 
 
+  /* Spaces are blank, so values can be padded; everything else that
+     isn't a digit becomes a dash. */
+
+  if (c == ' ') {
+    return 0;
+  }
+
   if ((c >= '0') && (c <= '9')) {
     code = ltm_find_alphanum_code(c);
   }
@@ -357,30 +458,70 @@ void ltm_clear_numeric(uint8_t block[5][5])
   }
 }
 
+/* Light the segments in "code" at one of the numeric positions.
+   Segments already lit there are left alone. */
+
+void ltm_set_numeric_code(int pos, uint8_t code, uint8_t block[5][5])
+{
+  int block_index = ((pos % 2) == 0) ? 1 : 2;
+
+  if (pos < 2) {
+    block[block_index][1] = block[block_index][1] | ((code & 0xC0) >> 6);
+    block[block_index][2] = block[block_index][2] | ((code & 0x3E) << 2);
+  } else {
+    block[block_index][2] = block[block_index][2] | ((code & 0xE0) >> 5);
+    block[block_index][3] = block[block_index][3] | ((code & 0x1E) << 3);
+  }
+}
+
+/* Read back the segments lit at one of the numeric positions. */
+
+uint8_t ltm_get_numeric_code(int pos, const uint8_t block[5][5])
+{
+  int block_index = ((pos % 2) == 0) ? 1 : 2;
+
+  if (pos < 2) {
+    return ((block[block_index][1] & 0x03) << 6) |
+      ((block[block_index][2] & 0xF8) >> 2);
+  }
+
+  return ((block[block_index][2] & 0x07) << 5) |
+    ((block[block_index][3] & 0xF0) >> 3);
+}
+
 /* Render the given string into the numeric section of the display. */
 
 void ltm_render_numeric(const char *render, uint8_t block[5][5])
 {
-  uint8_t code;
-  int i, block_index;
+  int i;
 
   ltm_clear_numeric(block);
 
-  for (i = 0; i < 4 && render[i] != '\0'; i++) {
-    code = ltm_find_numeric_code(render[i]);
+  for (i = 0; i < LTM_NUMERIC_LEN && render[i] != '\0'; i++) {
+    ltm_set_numeric_code(i, ltm_find_numeric_code(render[i]), block);
+  }
+}
 
-    if ((i % 2) == 0) {
-      block_index = 1;
-    } else {
-      block_index = 2;
-    }
+/* Light the colon dots given in the "dots" mask (see the LTM_COLON_*
+   defines).  All of the dots live in the first group; dots not in the
+   mask are turned off. */
 
-    if (i < 2) {
-      block[block_index][1] = block[block_index][1] | ((code & 0xC0) >> 6);
-      block[block_index][2] = block[block_index][2] | ((code & 0x3E) << 2);
-    } else {
-      block[block_index][2] = block[block_index][2] | ((code & 0xE0) >> 5);
-      block[block_index][3] = block[block_index][3] | ((code & 0x1E) << 3);
-    }
+void ltm_render_colons(uint8_t dots, uint8_t block[5][5])
+{
+  block[0][1] = block[0][1] & 0xFE;
+  block[0][2] = block[0][2] & 0x7F;
+  block[0][3] = block[0][3] & 0x9F;
+
+  if (dots & LTM_COLON_1_UPPER) {
+    block[0][1] = block[0][1] | 0x01;
+  }
+  if (dots & LTM_COLON_1_LOWER) {
+    block[0][2] = block[0][2] | 0x80;
+  }
+  if (dots & LTM_COLON_2_UPPER) {
+    block[0][3] = block[0][3] | 0x40;
+  }
+  if (dots & LTM_COLON_2_LOWER) {
+    block[0][3] = block[0][3] | 0x20;
   }
 }
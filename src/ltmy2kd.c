@@ -15,25 +15,101 @@
  * Currently, only the following commands are supported:
  *
  * ALPHA string   display the string on the alphanum-capable portion
- *                of the display.  Limited to 7 characters (extras are
- *                just dropped).  Only uppercase letters and numbers
+ *                of the display.  Limited to 7 characters per module
+ *                (extras are just dropped).  Only uppercase letters and numbers
  *                are supported; anything else is replaced with a '*'.
  * NUM string     display the string on the numeric-capable portion of
- *                the display.  Limited to 4 characters (extras are
- *                just dropped).  Only numbers are supported; anything
- *                else is replaced with a '-'.
+ *                the display.  Limited to 4 characters per module
+ *                (extras are just dropped).  Only numbers and spaces are supported;
+ *                anything else is replaced with a '-'.
+ * ALPHA "template"
+ * NUM "template" keep the field showing the template, with each
+ *                {source:width} placeholder filled in from one of the
+ *                daemon's data sources (cpu, load1, load5, load15,
+ *                temp, mem, hour, min, sec), as in "CPU{cpu:3}".
+ *                The sources are sampled on their own schedules, and
+ *                the field is redrawn when the text changes.  Any
+ *                other command for the field replaces the template.
+ * VALUE field number [options]
+ *                format a number and display it on the ALPHA or NUM
+ *                field.  Options are width=N (positions used by the
+ *                number), dec=N (decimal places; NUM only, using a
+ *                colon dot as the point), sign (always leave room for
+ *                a sign), units=STR (suffix; ALPHA only), and
+ *                deadband=X (ignore values closer than X to the one
+ *                last displayed).  The display is only re-rendered
+ *                when the formatted text actually changes.
+ * TRANSITION field effect [ms]
+ *                animate changes to the ALPHA or NUM field.  The
+ *                effect is WIPE, BUILD, SLIDE, FADE or NONE, and the
+ *                animation takes about ms milliseconds (default 300).
+ *
+ * The same commands can also be sent as datagrams to the socket
+ * /run/ltmy2kd.sock, and both the pipe and the socket take the binary
+ * messages described in ltmy2kd_proto.h, which also cover raw frames,
+ * segment masks and transactions.
+ *
+ * Sending SIGUSR1 writes refresh statistics, including the estimated
+ * LED drive load, to /run/ltmy2kd.stats.
+ *
+ * Options:
+ *
+ * -c mA          cap the average LED drive current.  Frames that would
+ *                draw more are dimmed by shortening each group's dwell.
+ * -s mA          drive current of a single lit segment, used for the
+ *                load estimate (default 10).
+ * -k device      let the ltmy2k kernel module (usually /dev/ltmy2k) do
+ *                the refreshing; we just write it new frames.  The
+ *                power cap isn't applied in this mode.
+ * -f             stay in the foreground instead of daemonizing.
+ * -n fd          in the foreground, write a newline to this file
+ *                descriptor once we're ready.
+ * -t minutes     blank the display after this long without commands;
+ *                the next command brings it straight back.  While
+ *                blank, the daemon does no periodic work at all (data
+ *                sources for templates aren't sampled either).
+ * -D mA          with -t, dim the display to about this load instead
+ *                of blanking it.
+ * -e             count CPU cycles, instructions, context switches and
+ *                page faults for each refresh step (as far as the
+ *                system allows), and add their distributions to the
+ *                stats.
+ * -m data,clock,reset
+ *                add a display module on these GPIO pins to the right
+ *                end of the panel (up to MAX_MODULES).  Without -m,
+ *                there's one module on the default pins.
+ * -j fields      which fields run across all the modules as one:
+ *                alpha, num, alpha,num (the default) or none.  A field
+ *                that isn't joined is shown the same on every module.
+ * -T threads     refresh the modules from this many real-time threads,
+ *                each pinned to its own core, rather than a thread
+ *                per module.  Each thread steps whichever module is
+ *                due soonest.  Can't be used with -e.
+ *
+ * Startup is arranged so the display is lit (blank) as soon as
+ * possible.  Once it is, and the command pipe is open, we tell
+ * whoever started us: the parent of a daemonized process waits for
+ * this before exiting, a notification goes to $NOTIFY_SOCKET if set
+ * (as systemd expects), and -n writes to its descriptor.  The time
+ * taken to get there is logged and shown in the stats.
  *
  * The display also supports colons in two places (with each dot
  * indivudually addressable) and four icons, so this list of commands
  * may grow.  Each command may pass no string, which blanks out the
  * display.
  *
- * The code assumes a Raspberry Pi GPIO setup, with certain pins
- * defined as the data, clock, and reset pins.  Changing these will
- * require editing the source code and rebuilding.  A patch to make
- * this configurable would be welcome.
+ * The code assumes a Raspberry Pi GPIO setup.  The default data,
+ * clock, and reset pins are defined below; -m picks others.
+ *
+ * With several modules, a joined field is rendered once over the
+ * whole panel and then split into each module's frame, and every
+ * change is handed to all the refresh engines under their locks
+ * together.  Binary raw frames and segment masks address a single
+ * module by the message's field byte.
  */
 
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,8 +122,19 @@
 #include <sched.h>
 #include <syslog.h>
 #include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
+#include "gpio.h"
 #include "ltmy2k19jf03.h"
+#include "ltm_refresh.h"
+#include "ltm_runner.h"
+#include "ltm_transition.h"
+#include "ltmy2kd_proto.h"
+#include "ltmy2kd_template.h"
 
 /* GPIO pins to control the display. */
 
@@ -60,31 +147,154 @@
 #define GPIO_SEG_RESET 27
 #endif
 
+/* Most display modules that can be chained into one panel. */
+
+#define MAX_MODULES 16
+
 /* Named pipe to use for receiving commands. */
 
 #define CMD_PATH "/run/ltmy2kd"
 
+/* Datagram socket, also for receiving commands. */
+
+#define SOCK_PATH "/run/ltmy2kd.sock"
+
 /* PID file, to prevent running more than once. */
 
 #define PID_FILE "/run/ltmy2kd.pid"
 
-/* Timeouts for polling.  We set a long timeout when the display is
-   blank, because we don't have to really do anything in that case. */
+/* Where to write statistics when asked with SIGUSR1. */
+
+#define STATS_PATH "/run/ltmy2kd.stats"
+
+/* Refresh timing, in milliseconds.  When the display is blank, the
+   refresh thread doesn't wake up at all until something changes. */
 
-#define POLL_TIMEOUT_BLANK 5000
 #define POLL_TIMEOUT_DATA 2
 
+/* SCHED_FIFO priority of the refresh thread. */
+
+#define REFRESH_PRIORITY 1
+
+/* Size of the buffer for incoming commands. */
+
+#define CMD_BUF_SIZE 256
+
+/* Field identifiers, used as command codes and array indexes. */
+
+#define FIELD_ALPHA LTM_FIELD_ALPHANUM
+#define FIELD_NUMERIC LTM_FIELD_NUMERIC
+
+/* How long a transaction on the command pipe may hold back changes
+   before we give up waiting for its commit, in milliseconds. */
+
+#define TRANSACTION_TIMEOUT_MS 250
+
+/* Default length of a transition, in milliseconds. */
+
+#define TRANSITION_DEFAULT_MS 300
+
+/* Formatting options and last displayed value for the VALUE
+   command. */
+
+struct value_format {
+  int width;
+  int decimals;
+  int sign;
+  char units[LTM_ALPHANUM_LEN + 1];
+  double deadband;
+};
+
+struct value_state {
+  int valid;
+  double value;
+  struct value_format format;
+};
+
 /* Global state. */
 
-char alphanum_string[8] = "";
-char numeric_string[5] = "";
+char alphanum_string[LTM_ALPHANUM_LEN * MAX_MODULES + 1] = "";
+char numeric_string[LTM_NUMERIC_LEN * MAX_MODULES + 1] = "";
+uint8_t colon_dots = 0;
+
+struct value_state field_values[2];
 
-uint8_t block[5][5] = 
-  { { 0x00, 0x00, 0x00, 0x04, 0x00 },
-    { 0x00, 0x00, 0x00, 0x02, 0x00 },
-    { 0x00, 0x00, 0x00, 0x01, 0x00 },
-    { 0x00, 0x00, 0x00, 0x00, 0x80 },
-    { 0x00, 0x00, 0x00, 0x00, 0x40 } };
+struct template field_templates[2];
+int template_bound[2] = { 0, 0 };
+
+int field_transitions[2] = { LTM_TRANSITION_NONE, LTM_TRANSITION_NONE };
+int field_transition_ms[2] = { TRANSITION_DEFAULT_MS, TRANSITION_DEFAULT_MS };
+struct ltm_frame transition_frames[LTM_TRANSITION_MAX_FRAMES];
+
+/* Binary message state for each place commands come from: whether
+   a transaction is holding back changes, and sequence number
+   tracking.  The header doesn't say who sent a message, so sequence
+   gaps are only meaningful with one producer per channel. */
+
+struct channel {
+  int in_transaction;
+  int transaction_dirty;
+  long transaction_deadline_us;
+  int have_seq;
+  uint16_t last_seq;
+};
+
+struct channel pipe_channel;
+struct channel socket_channel;
+struct channel *current_channel = NULL;
+
+unsigned long binary_messages = 0;
+unsigned long seq_gaps = 0;
+
+/* Make sure the message layout is what the protocol says. */
+
+typedef char ltm_msg_size_check[(sizeof(struct ltm_msg) == LTM_MSG_SIZE) ?
+                                1 : -1];
+
+/* The panel: one or more modules chained left to right.  Each has
+   its own pins, frame and refresh engine.  A joined field runs across
+   all of them as one long field; one that isn't is shown the same on
+   every module. */
+
+struct module {
+  struct ltm_display display;
+  struct ltm_refresh refresh;
+  uint8_t block[5][5];
+  uint8_t idle_saved[5][5];
+};
+
+struct module modules[MAX_MODULES];
+int nmodules = 0;
+int field_joined[2] = { 1, 1 };
+
+/* With -T, the modules share a runner's threads instead of having
+   one each. */
+
+struct ltm_runner runner;
+int runner_threads = 0;
+
+volatile sig_atomic_t stats_requested = 0;
+
+/* Startup timing, in microseconds from when we were started. */
+
+struct timespec start_time;
+long first_frame_us = 0;
+long ready_us = 0;
+
+/* Inactivity handling: after idle_timeout_us with no commands, the
+   display is blanked (or, if idle_dim_ma is set, dimmed to about that
+   load) until the next one arrives.  While blanked, nothing in the
+   daemon wakes up on a timer. */
+
+long idle_timeout_us = 0;
+long idle_dim_ma = 0;
+long last_activity_us = 0;
+int idle = 0;
+unsigned long idle_entries = 0;
+
+/* Kernel device write errors we've already logged. */
+
+unsigned long logged_write_errors = 0;
 
 /* Error reporting after daemonizing. */
 
@@ -93,12 +303,471 @@ void record_errno_error(const char *errmsg)
   syslog(LOG_ERR, "%s: %s", errmsg, strerror(errno));
 }
 
+/* Microseconds since we started. */
+
+long since_start_us()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start_time.tv_sec) * 1000000L +
+    (now.tv_nsec - start_time.tv_nsec) / 1000;
+}
+
+/* Take and release every module's refresh lock, always in the same
+   order, so a change to the panel shows up on all of them at once. */
+
+void lock_panel()
+{
+  int i;
+
+  for (i = 0; i < nmodules; i++) {
+    ltm_refresh_lock(&modules[i].refresh);
+  }
+}
+
+void unlock_panel()
+{
+  int i;
+
+  for (i = nmodules - 1; i >= 0; i--) {
+    ltm_refresh_unlock(&modules[i].refresh);
+  }
+}
+
+/* Length of a field across the panel. */
+
+int field_length(int field)
+{
+  int len = (field == FIELD_ALPHA) ? LTM_ALPHANUM_LEN : LTM_NUMERIC_LEN;
+
+  return field_joined[field] ? len * nmodules : len;
+}
+
+/* Hand the module blocks to their refresh engines, through a
+   transition if one is set for the field that changed (field is -1
+   if it wasn't just one field).  In a transaction on the channel
+   whose commands we're running, this waits for the commit. */
+
+void publish_block(int field)
+{
+  struct module *m;
+  int cycles, nframes, i;
+
+  if ((current_channel != NULL) && current_channel->in_transaction) {
+    current_channel->transaction_dirty = 1;
+    return;
+  }
+
+  for (i = 0; i < nmodules; i++) {
+    m = &modules[i];
+
+    /* While blanked for inactivity, just remember it for later. */
+
+    if (idle && (idle_dim_ma == 0)) {
+      memcpy(m->idle_saved, m->block, sizeof(m->idle_saved));
+      continue;
+    }
+
+    nframes = 0;
+    if ((field >= 0) && (field_transitions[field] != LTM_TRANSITION_NONE)) {
+      cycles = field_transition_ms[field] * 1000L /
+        (m->refresh.period_us * 5);
+      nframes = ltm_transition_build(field_transitions[field], field,
+                                     m->refresh.frame, m->block, cycles,
+                                     transition_frames);
+    }
+
+    if (nframes > 0) {
+      ltm_refresh_play(&m->refresh, transition_frames, nframes, m->block);
+    } else {
+      ltm_refresh_set_frame(&m->refresh, m->block);
+    }
+  }
+}
+
+/* The part of a field string that lands on the given module. */
+
+const char *field_slice(int field, const char *field_string, int module)
+{
+  size_t offset;
+
+  if (!field_joined[field]) {
+    return field_string;
+  }
+
+  offset = module * ((field == FIELD_ALPHA) ?
+                     LTM_ALPHANUM_LEN : LTM_NUMERIC_LEN);
+  if (offset > strlen(field_string)) {
+    offset = strlen(field_string);
+  }
+  return field_string + offset;
+}
+
+/* Render a field whose string has changed, split across the modules,
+   and show it.  A joined numeric field's decimal point is on the
+   last module. */
+
+void render_field(int field)
+{
+  uint8_t dots;
+  int i;
+
+  for (i = 0; i < nmodules; i++) {
+    if (field == FIELD_ALPHA) {
+      ltm_render_alphanum(field_slice(field, alphanum_string, i),
+                          modules[i].block);
+    } else {
+      dots = colon_dots;
+      if (field_joined[field] && (i < nmodules - 1)) {
+        dots = dots & ~LTM_NUMERIC_POINT;
+      }
+      ltm_render_numeric(field_slice(field, numeric_string, i),
+                         modules[i].block);
+      ltm_render_colons(dots, modules[i].block);
+    }
+  }
+
+  publish_block(field);
+}
+
+/* Replace the string shown in a field, re-rendering only if the text
+   or the numeric decimal point actually changed. */
+
+void set_field_string(int field, const char *text, int point)
+{
+  char *field_string;
+  size_t field_len;
+  uint8_t new_dots;
+
+  field_len = field_length(field);
+  if (field == FIELD_ALPHA) {
+    field_string = alphanum_string;
+    new_dots = colon_dots;
+  } else {
+    field_string = numeric_string;
+    new_dots = colon_dots & ~LTM_NUMERIC_POINT;
+    if (point) {
+      new_dots = new_dots | LTM_NUMERIC_POINT;
+    }
+  }
+
+  if ((strncmp(field_string, text, field_len) == 0) &&
+      (new_dots == colon_dots)) {
+    return;
+  }
+
+  strncpy(field_string, text, field_len);
+  field_string[field_len] = '\0';
+  colon_dots = new_dots;
+  render_field(field);
+}
+
+/* Sample exactly the sources the bound templates need; none at all
+   while we're idle. */
+
+void use_template_sources()
+{
+  int i;
+
+  sources_clear_use();
+  if (idle) {
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    if (template_bound[i]) {
+      sources_use(&field_templates[i]);
+    }
+  }
+}
+
+/* Bind a compiled template to a field, or unbind whatever template
+   it has if t is NULL, and make sure exactly the sources the bound
+   templates need are being sampled. */
+
+void bind_template(int field, const struct template *t)
+{
+  if (t != NULL) {
+    field_templates[field] = *t;
+    field_values[field].valid = 0;
+  } else if (!template_bound[field]) {
+    return;
+  }
+  template_bound[field] = (t != NULL);
+  use_template_sources();
+}
+
+/* Fill in the bound templates with the latest source values.
+   set_field_string takes care of only redrawing what changed. */
+
+void update_templates()
+{
+  char text[LTM_ALPHANUM_LEN * MAX_MODULES + 1];
+  int field;
+
+  for (field = 0; field < 2; field++) {
+    if (template_bound[field]) {
+      template_expand(&field_templates[field], text, sizeof(text));
+      set_field_string(field, text, 0);
+    }
+  }
+}
+
+/* Format a number for a field according to the given format.  The
+   result is padded with spaces to the full field width, so it can be
+   compared against the current field string.  Returns 0 on success,
+   or -1 if the format can't be used on the field. */
+
+int format_value(int field, double value, const struct value_format *format,
+                 char *out, int *point)
+{
+  char magnitude[LTM_ALPHANUM_LEN * MAX_MODULES + 2];
+  char digits[LTM_ALPHANUM_LEN * MAX_MODULES + 3];
+  const char *sign;
+  char *frac;
+  int field_len, point_pos, avail, width, int_width, len, i;
+
+  /* A joined numeric field has its point on the last module. */
+
+  field_len = field_length(field);
+  point_pos = field_len - LTM_NUMERIC_LEN + LTM_NUMERIC_POINT_POS;
+  *point = 0;
+
+  if ((field == FIELD_ALPHA) && (format->decimals > 0)) {
+    return -1;
+  }
+  if ((field == FIELD_NUMERIC) &&
+      ((format->units[0] != '\0') ||
+       (format->decimals > field_len - point_pos))) {
+    return -1;
+  }
+
+  memset(out, ' ', field_len);
+  out[field_len] = '\0';
+
+  if (!isfinite(value)) {
+    memset(out, '-', field_len);
+    return 0;
+  }
+
+  /* Format the magnitude first, so values that round to zero don't
+     get a minus sign.  ALPHA can show a plus sign; NUM can only leave
+     a blank. */
+
+  snprintf(magnitude, sizeof(magnitude), "%.*f", format->decimals,
+           (value < 0) ? -value : value);
+  if ((value < 0) && (strspn(magnitude, "0.") != strlen(magnitude))) {
+    sign = "-";
+  } else if (format->sign) {
+    sign = ((field == FIELD_ALPHA) ? "+" : " ");
+  } else {
+    sign = "";
+  }
+  snprintf(digits, sizeof(digits), "%s%s", sign, magnitude);
+
+  /* With a decimal point, the point position on the display is
+     fixed; line the integer part up to the left of it and put the
+     fraction digits after it.  A width counts the fraction digits,
+     and leaves less room for the integer part.  Anything too big for
+     the room we have (including a magnitude too long to have kept
+     its point) shows as dashes. */
+
+  if (format->decimals > 0) {
+    int_width = point_pos;
+    if ((format->width > 0) &&
+        (format->width - format->decimals < int_width)) {
+      int_width = format->width - format->decimals;
+    }
+    if (int_width < 1) {
+      return -1;
+    }
+
+    frac = strchr(digits, '.');
+    if ((frac == NULL) || (frac - digits > int_width)) {
+      memset(out + point_pos - int_width, '-',
+             int_width + format->decimals);
+      return 0;
+    }
+    *frac = '\0';
+    frac++;
+    len = strlen(digits);
+    memcpy(out + point_pos - len, digits, len);
+    memcpy(out + point_pos, frac, strlen(frac));
+    *point = 1;
+    return 0;
+  }
+
+  avail = field_len - strlen(format->units);
+  width = format->width;
+  if ((width <= 0) || (width > avail)) {
+    width = avail;
+  }
+
+  len = strlen(digits);
+
+  if (len > width) {
+    for (i = avail - width; i < avail; i++) {
+      out[i] = '-';
+    }
+  } else {
+    memcpy(out + avail - len, digits, len);
+  }
+  memcpy(out + avail, format->units, strlen(format->units));
+
+  return 0;
+}
+
+/* Compare two formats field by field; the structure's padding isn't
+   guaranteed to match even when the formats do. */
+
+int same_format(const struct value_format *a, const struct value_format *b)
+{
+  return (a->width == b->width) && (a->decimals == b->decimals) &&
+    (a->sign == b->sign) && (strcmp(a->units, b->units) == 0) &&
+    (a->deadband == b->deadband);
+}
+
+/* Show a number on a field, unless it's inside the deadband of the
+   last one shown there. */
+
+void apply_value(int field, double value, const struct value_format *format)
+{
+  struct value_state *state;
+  char text[LTM_ALPHANUM_LEN * MAX_MODULES + 1];
+  int point;
+
+  /* Inside the deadband, the sample is just noise; skip formatting
+     entirely.  A format change always goes through. */
+
+  bind_template(field, NULL);
+  state = &field_values[field];
+  if (state->valid &&
+      same_format(&state->format, format) &&
+      (value > state->value - format->deadband) &&
+      (value < state->value + format->deadband)) {
+    return;
+  }
+
+  if (format_value(field, value, format, text, &point) != 0) {
+    syslog(LOG_WARNING, "VALUE: format not supported on this field");
+    return;
+  }
+
+  state->valid = 1;
+  state->value = value;
+  state->format = *format;
+
+  set_field_string(field, text, point);
+}
+
+/* Handle the VALUE command.  The arguments are the field name, the
+   number, and any formatting options. */
+
+void parse_value_command(char *args)
+{
+  struct value_format format;
+  char *token, *end;
+  double value;
+  int field;
+
+  token = strtok(args, " \n");
+  if (token == NULL) {
+    return;
+  }
+  if (strcmp(token, "ALPHA") == 0) {
+    field = FIELD_ALPHA;
+  } else if (strcmp(token, "NUM") == 0) {
+    field = FIELD_NUMERIC;
+  } else {
+    syslog(LOG_WARNING, "VALUE: unknown field %s", token);
+    return;
+  }
+
+  token = strtok(NULL, " \n");
+  if (token == NULL) {
+    return;
+  }
+  value = strtod(token, &end);
+  if ((end == token) || (*end != '\0') || !isfinite(value)) {
+    syslog(LOG_WARNING, "VALUE: bad number %s", token);
+    return;
+  }
+
+  memset(&format, 0, sizeof(format));
+  while ((token = strtok(NULL, " \n")) != NULL) {
+    if (strncmp(token, "width=", 6) == 0) {
+      format.width = strtol(token + 6, &end, 10);
+      if ((end == token + 6) || (*end != '\0') || (format.width < 0)) {
+        syslog(LOG_WARNING, "VALUE: bad width %s", token + 6);
+        return;
+      }
+    } else if (strncmp(token, "dec=", 4) == 0) {
+      format.decimals = strtol(token + 4, &end, 10);
+      if ((end == token + 4) || (*end != '\0') || (format.decimals < 0)) {
+        syslog(LOG_WARNING, "VALUE: bad decimals %s", token + 4);
+        return;
+      }
+    } else if (strcmp(token, "sign") == 0) {
+      format.sign = 1;
+    } else if (strncmp(token, "units=", 6) == 0) {
+      strncpy(format.units, token + 6, LTM_ALPHANUM_LEN);
+      format.units[LTM_ALPHANUM_LEN] = '\0';
+    } else if (strncmp(token, "deadband=", 9) == 0) {
+      format.deadband = strtod(token + 9, NULL);
+    } else {
+      syslog(LOG_WARNING, "VALUE: unknown option %s", token);
+      return;
+    }
+  }
+
+  apply_value(field, value, &format);
+}
+
+/* Handle the TRANSITION command: the field, the effect name, and
+   optionally how long it should take. */
+
+void parse_transition_command(char *args)
+{
+  char *token;
+  int field, effect;
+
+  token = strtok(args, " \n");
+  if (token == NULL) {
+    return;
+  }
+  if (strcmp(token, "ALPHA") == 0) {
+    field = FIELD_ALPHA;
+  } else if (strcmp(token, "NUM") == 0) {
+    field = FIELD_NUMERIC;
+  } else {
+    syslog(LOG_WARNING, "TRANSITION: unknown field %s", token);
+    return;
+  }
+
+  token = strtok(NULL, " \n");
+  effect = (token != NULL) ? ltm_transition_find(token) : -1;
+  if (effect < 0) {
+    syslog(LOG_WARNING, "TRANSITION: unknown effect");
+    return;
+  }
+
+  field_transitions[field] = effect;
+  field_transition_ms[field] = TRANSITION_DEFAULT_MS;
+
+  token = strtok(NULL, " \n");
+  if (token != NULL) {
+    field_transition_ms[field] = strtol(token, NULL, 10);
+  }
+}
+
 /* Parse a command string and render its result. */
 
 void parse_command(char *command)
 {
-  char *token;
+  struct template t;
+  char *token, *end;
   int found_cmd = 0;
+  int field;
 
   /* Figure out which command was given. */
 
@@ -111,65 +780,622 @@ void parse_command(char *command)
     found_cmd = 1;
   } else if (strcmp(token, "NUM") == 0) {
     found_cmd = 2;
+  } else if (strcmp(token, "VALUE") == 0) {
+    parse_value_command(strtok(NULL, "\n"));
+    return;
+  } else if (strcmp(token, "TRANSITION") == 0) {
+    parse_transition_command(strtok(NULL, "\n"));
+    return;
   }
 
-  /* Read the rest of the line as the string to output. */
+  if (found_cmd == 0) {
+    return;
+  }
+  field = (found_cmd == 1) ? FIELD_ALPHA : FIELD_NUMERIC;
+
+  /* Read the rest of the line as the string to output.  A quoted
+     string is a template; plain strings take the field over from any
+     template or VALUE formatting. */
 
   token = strtok(NULL, "\n");
+  if (token == NULL) {
+    token = "";
+  }
 
-  if (token != NULL) {
-    if (found_cmd == 1) {
-      strncpy(alphanum_string, token, 8);
-    } else if (found_cmd == 2) {
-      strncpy(numeric_string, token, 5);
+  if (token[0] == '"') {
+    token++;
+    end = strrchr(token, '"');
+    if (end != NULL) {
+      *end = '\0';
     }
-  } else {
-    if (found_cmd == 1) {
-      alphanum_string[0] = '\0';
-    } else if (found_cmd == 2) {
-      numeric_string[0] = '\0';
+    if (template_compile(token, &t) != 0) {
+      syslog(LOG_WARNING, "bad template \"%s\"", token);
+      return;
+    }
+    bind_template(field, &t);
+    update_templates();
+    return;
+  }
+
+  bind_template(field, NULL);
+  field_values[field].valid = 0;
+  set_field_string(field, token, 0);
+}
+
+/* End the transaction on a channel, and show what it held back. */
+
+void end_transaction(struct channel *ch)
+{
+  struct channel *saved = current_channel;
+
+  ch->in_transaction = 0;
+  if (ch->transaction_dirty) {
+    ch->transaction_dirty = 0;
+    current_channel = ch;
+    publish_block(-1);
+    current_channel = saved;
+  }
+}
+
+/* Handle a binary message from the current channel. */
+
+void handle_message(const struct ltm_msg *msg)
+{
+  struct channel *ch = current_channel;
+  struct value_format format;
+  char text[sizeof(msg->payload.text) + 1];
+  double scale;
+  uint8_t (*block)[5];
+  int field = msg->header.field;
+  int i, j;
+
+  binary_messages++;
+  if (ch->have_seq && (msg->header.seq != (uint16_t)(ch->last_seq + 1))) {
+    seq_gaps++;
+  }
+  ch->have_seq = 1;
+  ch->last_seq = msg->header.seq;
+
+  if (((msg->header.opcode == LTM_OP_SET_FIELD) ||
+       (msg->header.opcode == LTM_OP_VALUE)) &&
+      (field != FIELD_ALPHA) && (field != FIELD_NUMERIC)) {
+    syslog(LOG_WARNING, "binary message for unknown field %d", field);
+    return;
+  }
+
+  /* Frames and masks use the field for the module they're for. */
+
+  if (((msg->header.opcode == LTM_OP_RAW_FRAME) ||
+       (msg->header.opcode == LTM_OP_SEGMENT_MASK)) &&
+      (field >= nmodules)) {
+    syslog(LOG_WARNING, "binary message for unknown module %d", field);
+    return;
+  }
+
+  switch (msg->header.opcode) {
+  case LTM_OP_SET_FIELD:
+    memcpy(text, msg->payload.text, sizeof(msg->payload.text));
+    text[sizeof(msg->payload.text)] = '\0';
+    bind_template(field, NULL);
+    field_values[field].valid = 0;
+    set_field_string(field, text, 0);
+    break;
+
+  case LTM_OP_RAW_FRAME:
+    block = modules[field].block;
+    memcpy(block, msg->payload.frame, sizeof(modules[field].block));
+    ltm_select_groups(block);
+    alphanum_string[0] = '\0';
+    numeric_string[0] = '\0';
+    colon_dots = 0;
+    bind_template(FIELD_ALPHA, NULL);
+    bind_template(FIELD_NUMERIC, NULL);
+    field_values[FIELD_ALPHA].valid = 0;
+    field_values[FIELD_NUMERIC].valid = 0;
+    publish_block(-1);
+    break;
+
+  case LTM_OP_SEGMENT_MASK:
+    block = modules[field].block;
+    for (i = 0; i < 5; i++) {
+      for (j = 0; j < 4; j++) {
+        if (msg->header.flags & LTM_MSG_FLAG_CLEAR) {
+          block[i][j] = block[i][j] & ~msg->payload.frame[i][j];
+        } else {
+          block[i][j] = block[i][j] | msg->payload.frame[i][j];
+        }
+      }
+    }
+    ltm_select_groups(block);
+    publish_block(-1);
+    break;
+
+  case LTM_OP_VALUE:
+    memset(&format, 0, sizeof(format));
+    format.width = msg->payload.value.width;
+    format.decimals = msg->payload.value.decimals;
+    format.sign = (msg->header.flags & LTM_MSG_FLAG_SIGN) ? 1 : 0;
+    for (i = 0; i < LTM_ALPHANUM_LEN && msg->payload.value.units[i]; i++) {
+      format.units[i] = msg->payload.value.units[i];
+    }
+    scale = 1.0;
+    for (i = 0; i < msg->payload.value.scale; i++) {
+      scale = scale * 10.0;
+    }
+    format.deadband = msg->payload.value.deadband / scale;
+    apply_value(field, msg->payload.value.value / scale, &format);
+    break;
+
+  case LTM_OP_BEGIN:
+    ch->in_transaction = 1;
+    ch->transaction_deadline_us = since_start_us() +
+      TRANSACTION_TIMEOUT_MS * 1000L;
+    break;
+
+  case LTM_OP_COMMIT:
+    end_transaction(ch);
+    break;
+
+  default:
+    syslog(LOG_WARNING, "unknown binary opcode %d", msg->header.opcode);
+  }
+}
+
+/* Work through the buffered input.  Binary messages start with
+   LTM_MSG_MAGIC and are always LTM_MSG_SIZE bytes long; anything else
+   is a line of text to run as a command.  Writes to the pipe of less
+   than PIPE_BUF bytes are atomic, so a trailing text fragment left
+   over after a short read is a complete command sent without a
+   newline.  Returns the number of bytes left in the buffer. */
+
+size_t process_commands(struct channel *ch, char *buf, size_t len,
+                        int short_read)
+{
+  struct ltm_msg msg;
+  char *line_end;
+  size_t used;
+
+  current_channel = ch;
+
+  while (len > 0) {
+    if ((uint8_t)buf[0] == LTM_MSG_MAGIC) {
+      if (len < LTM_MSG_SIZE) {
+        break;
+      }
+      memcpy(&msg, buf, LTM_MSG_SIZE);
+      handle_message(&msg);
+      used = LTM_MSG_SIZE;
+    } else {
+      line_end = memchr(buf, '\n', len);
+      if (line_end == NULL) {
+        if (!short_read && (len < CMD_BUF_SIZE - 1)) {
+          break;
+        }
+        line_end = buf + len;
+      }
+      *line_end = '\0';
+      parse_command(buf);
+      used = (line_end == buf + len) ? len : (size_t)(line_end - buf + 1);
+    }
+    len -= used;
+    memmove(buf, buf + used, len);
+  }
+
+  current_channel = NULL;
+  return len;
+}
+
+/* Signal handler for SIGUSR1; the stats get written from the main
+   loop. */
+
+void request_stats(int signum)
+{
+  stats_requested = 1;
+}
+
+/* Write the current statistics to the stats file.  The refresh
+   numbers are for the first module; with more than one, each also
+   gets a line of its own. */
+
+void write_stats()
+{
+  struct ltm_refresh *refresh = &modules[0].refresh;
+  FILE *stats_file;
+  const struct ltm_perf_dist *d;
+  int i, j, last;
+
+  stats_file = fopen(STATS_PATH, "w");
+  if (stats_file == NULL) {
+    record_errno_error("could not write stats");
+    return;
+  }
+
+  fprintf(stats_file, "cycles %lu\n", refresh->stats.cycles);
+  fprintf(stats_file, "lit_segments");
+  for (i = 0; i < 5; i++) {
+    fprintf(stats_file, " %d", refresh->stats.lit_segments[i]);
+  }
+  fprintf(stats_file, "\n");
+  fprintf(stats_file, "segment_ma %ld\n", refresh->segment_ma);
+  fprintf(stats_file, "load_ma %ld\n", refresh->stats.load_ma);
+  fprintf(stats_file, "power_cap_ma %ld\n", refresh->power_cap_ma);
+  fprintf(stats_file, "capped_load_ma %ld\n", refresh->stats.capped_load_ma);
+  fprintf(stats_file, "duty_permille %d\n", refresh->stats.duty_permille);
+  fprintf(stats_file, "steps %lu\n", refresh->stats.steps);
+  fprintf(stats_file, "overruns %lu\n", refresh->stats.overruns);
+  fprintf(stats_file, "deadline_misses %lu\n",
+          refresh->stats.deadline_misses);
+  fprintf(stats_file, "late_max_us %ld\n", refresh->stats.late_max_us);
+  fprintf(stats_file, "cpu_us %lld\n", refresh->stats.cpu_us);
+  fprintf(stats_file, "first_frame_us %ld\n", first_frame_us);
+  fprintf(stats_file, "ready_us %ld\n", ready_us);
+  fprintf(stats_file, "binary_messages %lu\n", binary_messages);
+  fprintf(stats_file, "seq_gaps %lu\n", seq_gaps);
+  fprintf(stats_file, "device_write_errors %lu\n",
+          refresh->stats.write_errors);
+  fprintf(stats_file, "idle %d\n", idle);
+  fprintf(stats_file, "idle_entries %lu\n", idle_entries);
+  fprintf(stats_file, "refresh_parks %lu\n", refresh->stats.parks);
+
+  if (nmodules > 1) {
+    for (i = 0; i < nmodules; i++) {
+      refresh = &modules[i].refresh;
+      fprintf(stats_file, "module%d cycles %lu steps %lu overruns %lu "
+              "deadline_misses %lu late_max_us %ld cpu_us %lld "
+              "load_ma %ld\n", i, refresh->stats.cycles,
+              refresh->stats.steps, refresh->stats.overruns,
+              refresh->stats.deadline_misses, refresh->stats.late_max_us,
+              refresh->stats.cpu_us, refresh->stats.load_ma);
+    }
+    refresh = &modules[0].refresh;
+  }
+
+  /* Per-step counter distributions: a summary line, and the
+     power-of-two histogram (see ltm_perf.h) up to the last bucket
+     that has anything in it. */
+
+  for (i = 0; i < LTM_PERF_COUNTERS; i++) {
+    if (!ltm_perf_available(&refresh->perf, i)) {
+      continue;
+    }
+    d = &refresh->perf.dist[i];
+    fprintf(stats_file, "perf_%s samples %lu mean %.1f p50 %llu p99 %llu "
+            "max %llu\n", ltm_perf_name(i), d->samples,
+            d->samples ? (double)d->total / d->samples : 0.0,
+            ltm_perf_percentile(d, 50), ltm_perf_percentile(d, 99), d->max);
+    for (last = LTM_PERF_BUCKETS - 1; (last > 0) && !d->buckets[last];
+         last--) {
+    }
+    fprintf(stats_file, "perf_%s_hist", ltm_perf_name(i));
+    for (j = 0; j <= last; j++) {
+      fprintf(stats_file, " %lu", d->buckets[j]);
+    }
+    fprintf(stats_file, "\n");
+  }
+
+  fclose(stats_file);
+}
+
+/* Blank or dim the display for inactivity.  What was showing (or
+   being transitioned to) is kept, to come back instantly.  Call with
+   the panel locked. */
+
+void enter_idle()
+{
+  struct module *m;
+  uint8_t blank[5][5];
+  int i;
+
+  idle = 1;
+  idle_entries++;
+  use_template_sources();
+
+  memset(blank, 0, sizeof(blank));
+  ltm_select_groups(blank);
+
+  for (i = 0; i < nmodules; i++) {
+    m = &modules[i];
+    if (idle_dim_ma > 0) {
+      ltm_refresh_set_power_cap(&m->refresh, m->refresh.segment_ma,
+                                idle_dim_ma);
+    } else {
+      memcpy(m->idle_saved, m->refresh.target, sizeof(m->idle_saved));
+      ltm_refresh_set_frame(&m->refresh, blank);
     }
   }
+}
+
+/* Put things back as they were before we went idle.  Call with the
+   panel locked. */
+
+void leave_idle(long power_cap_ma)
+{
+  struct module *m;
+  int i;
 
-  /* Render the current results. */
+  idle = 0;
+  use_template_sources();
 
-  ltm_render_alphanum(alphanum_string, block);
-  ltm_render_numeric(numeric_string, block);
+  for (i = 0; i < nmodules; i++) {
+    m = &modules[i];
+    if (idle_dim_ma > 0) {
+      ltm_refresh_set_power_cap(&m->refresh, m->refresh.segment_ma,
+                                power_cap_ma);
+    } else {
+      ltm_refresh_set_frame(&m->refresh, m->idle_saved);
+    }
+  }
 }
 
-int main(int argc, char *argv)
+/* Something came in from a producer: wake up if we were idle, and
+   start the inactivity timer over. */
+
+void note_activity(long power_cap_ma)
+{
+  if (idle) {
+    leave_idle(power_cap_ma);
+  }
+  last_activity_us = since_start_us();
+}
+
+/* Log any new failures to write frames to the kernel device.  The
+   refresh thread keeps retrying them; this just makes sure someone
+   hears about it.  Call with the panel locked; the kernel device
+   only ever drives the first module. */
+
+void log_write_errors()
+{
+  struct ltm_refresh *refresh = &modules[0].refresh;
+
+  if (refresh->stats.write_errors != logged_write_errors) {
+    syslog(LOG_ERR, "could not write frame to kernel device "
+           "(%lu failures): %s", refresh->stats.write_errors,
+           strerror(refresh->stats.write_errno));
+    logged_write_errors = refresh->stats.write_errors;
+  }
+}
+
+/* Send a notification to $NOTIFY_SOCKET, if it's set.  This is the
+   same datagram protocol as systemd's sd_notify(). */
+
+void notify_socket(const char *message)
+{
+  const char *path = getenv("NOTIFY_SOCKET");
+  struct sockaddr_un addr;
+  size_t path_len;
+  int fd;
+
+  if ((path == NULL) || ((path[0] != '/') && (path[0] != '@'))) {
+    return;
+  }
+
+  path_len = strlen(path);
+  if (path_len >= sizeof(addr.sun_path)) {
+    return;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, path_len);
+  if (addr.sun_path[0] == '@') {
+    addr.sun_path[0] = '\0';
+  }
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    record_errno_error("could not create notify socket");
+    return;
+  }
+
+  if (sendto(fd, message, strlen(message), 0, (struct sockaddr *)&addr,
+             offsetof(struct sockaddr_un, sun_path) + path_len) < 0) {
+    record_errno_error("could not send readiness notification");
+  }
+
+  close(fd);
+}
+
+/* Add a module to the right end of the panel, from a -m option
+   giving its data, clock and reset pins. */
+
+int add_module(const char *pins)
+{
+  struct ltm_display *d;
+
+  if (nmodules >= MAX_MODULES) {
+    return -1;
+  }
+
+  d = &modules[nmodules].display;
+  if (sscanf(pins, "%d,%d,%d", &d->data_pin, &d->clock_pin,
+             &d->reset_pin) != 3) {
+    return -1;
+  }
+
+  nmodules++;
+  return 0;
+}
+
+/* Choose the fields that run across the panel, from a -j option:
+   "alpha", "num", "alpha,num" or "none". */
+
+int set_joined_fields(const char *fields)
+{
+  if (strcmp(fields, "none") == 0) {
+    field_joined[FIELD_ALPHA] = 0;
+    field_joined[FIELD_NUMERIC] = 0;
+  } else if (strcmp(fields, "alpha") == 0) {
+    field_joined[FIELD_ALPHA] = 1;
+    field_joined[FIELD_NUMERIC] = 0;
+  } else if (strcmp(fields, "num") == 0) {
+    field_joined[FIELD_ALPHA] = 0;
+    field_joined[FIELD_NUMERIC] = 1;
+  } else if ((strcmp(fields, "alpha,num") == 0) ||
+             (strcmp(fields, "num,alpha") == 0)) {
+    field_joined[FIELD_ALPHA] = 1;
+    field_joined[FIELD_NUMERIC] = 1;
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
 {
   pid_t pid;
   int retval;
-  int pid_file_fd, cmd_fd, cmd_write_fd;
-  int current_block = 0;
-  int current_poll_timeout;
-  struct pollfd cmd_poll[1];
-  char command_buf[16];
+  int sources_changed;
+  long timeout_ms, wait_ms;
+  mode_t old_umask;
+  int pid_file_fd, cmd_fd, cmd_write_fd, sock_fd;
+  struct sockaddr_un sock_addr;
+  long segment_ma = LTM_SEGMENT_MA;
+  long power_cap_ma = 0;
+  const char *kernel_device = NULL;
+  int kernel_fd = -1;
+  int foreground = 0;
+  int perf = 0;
+  int priority = REFRESH_PRIORITY;
+  int bad_option = 0;
+  int i;
+  int ready_fd = -1;
+  int ready_pipe[2];
+  struct pollfd cmd_poll[2];
+  char command_buf[CMD_BUF_SIZE];
+  size_t command_len = 0;
+  char datagram_buf[CMD_BUF_SIZE];
   char pid_buf[8];
+  char notify_buf[80];
+  sigset_t signal_mask;
   ssize_t bytes_read;
-  struct sched_param policy_param;
+  int opt;
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-  /* Daemonize. */
+  /* Read the options. */
 
-  pid = fork();
-  if (pid < 0) {
-    perror("ltmy2kd: could not fork");
+  while ((opt = getopt(argc, argv, "c:s:k:fn:et:D:m:j:T:")) != -1) {
+    switch (opt) {
+    case 'c':
+      power_cap_ma = strtol(optarg, NULL, 10);
+      break;
+    case 's':
+      segment_ma = strtol(optarg, NULL, 10);
+      break;
+    case 'k':
+      kernel_device = optarg;
+      break;
+    case 'f':
+      foreground = 1;
+      break;
+    case 'n':
+      ready_fd = strtol(optarg, NULL, 10);
+      break;
+    case 'e':
+      perf = 1;
+      break;
+    case 't':
+      idle_timeout_us = (long)(strtod(optarg, NULL) * 60 * 1000000);
+      break;
+    case 'D':
+      idle_dim_ma = strtol(optarg, NULL, 10);
+      break;
+    case 'm':
+      if (add_module(optarg) != 0) {
+        fprintf(stderr, "ltmy2kd: bad module \"%s\" (want data,clock,reset; "
+                "at most %d)\n", optarg, MAX_MODULES);
+        bad_option = 1;
+      }
+      break;
+    case 'j':
+      if (set_joined_fields(optarg) != 0) {
+        fprintf(stderr, "ltmy2kd: bad field list \"%s\"\n", optarg);
+        bad_option = 1;
+      }
+      break;
+    case 'T':
+      runner_threads = strtol(optarg, NULL, 10);
+      if ((runner_threads < 1) ||
+          (runner_threads > LTM_RUNNER_MAX_THREADS)) {
+        fprintf(stderr, "ltmy2kd: -T takes 1 to %d threads\n",
+                LTM_RUNNER_MAX_THREADS);
+        bad_option = 1;
+      }
+      break;
+    default:
+      bad_option = 1;
+    }
+  }
+
+  if (perf && (runner_threads > 0)) {
+    fprintf(stderr, "ltmy2kd: -e can't count steps with -T\n");
+    bad_option = 1;
+  }
+
+  if ((kernel_device != NULL) && (nmodules > 1)) {
+    fprintf(stderr, "ltmy2kd: -k drives a single module\n");
+    bad_option = 1;
+  }
+
+  if (bad_option) {
+    fprintf(stderr, "usage: ltmy2kd [-c cap_mA] [-s segment_mA] "
+            "[-k device] [-f [-n fd]] [-e]\n"
+            "              [-t idle_minutes [-D dim_mA]]\n"
+            "              [-m data,clock,reset ...] [-j alpha,num|none] "
+            "[-T threads]\n");
     exit(1);
-  } else if (pid > 0) {
-    exit(0);
   }
 
-  umask(0);
-  setsid();
-  chdir("/");
-  close(0);
-  close(1);
-  close(2);
+  /* Without -m, there's one module on the usual pins. */
 
+  if (nmodules == 0) {
+    modules[0].display.data_pin = GPIO_SEG_DATA;
+    modules[0].display.clock_pin = GPIO_SEG_CLOCK;
+    modules[0].display.reset_pin = GPIO_SEG_RESET;
+    nmodules = 1;
+  }
+
+  /* Daemonize.  The parent hangs around until the child says it's
+     ready, so whatever started us can count on the display being
+     up once we exit. */
+
+  if (!foreground) {
+    if (pipe(ready_pipe) != 0) {
+      perror("ltmy2kd: could not create pipe");
+      exit(1);
+    }
+
+    pid = fork();
+    if (pid < 0) {
+      perror("ltmy2kd: could not fork");
+      exit(1);
+    } else if (pid > 0) {
+      close(ready_pipe[1]);
+      while (((bytes_read = read(ready_pipe[0], pid_buf, 1)) < 0) &&
+             (errno == EINTR)) {
+      }
+      exit((bytes_read == 1) ? 0 : 1);
+    }
+
+    close(ready_pipe[0]);
+    ready_fd = ready_pipe[1];
+
+    umask(0);
+    setsid();
+    chdir("/");
+    close(0);
+    close(1);
+    close(2);
+  }
+
+  /* Set up logging. */
+
+  openlog("ltmy2kd", 0, LOG_DAEMON);
   syslog(LOG_INFO, "starting, PID %d", getpid());
 
-  /* Check for PID file, and write it. */
+  /* Check for PID file, and write it.  This has to come before we
+     touch the display, in case another copy is already driving it. */
 
   pid_file_fd = open(PID_FILE, O_WRONLY | O_CREAT | O_EXCL);
   while (pid_file_fd < 0) {
@@ -202,14 +1428,100 @@ int main(int argc, char *argv)
   write(pid_file_fd, pid_buf, strlen(pid_buf));
   close(pid_file_fd);
 
-  /* Set up logging. */
+  /* Initialize the displays, or the kernel module's device, and get
+     the first (blank) frame refreshing right away.  Each module's
+     refresh thread gets real-time priority; the rest of us don't
+     need it. */
 
-  openlog("ltmy2kd", 0, LOG_DAEMON);
+  if (kernel_device != NULL) {
+    kernel_fd = open(kernel_device, O_WRONLY);
+    if (kernel_fd < 0) {
+      record_errno_error("could not open kernel display device");
+      exit(1);
+    }
+  } else {
+    retval = gpio_init();
+    if (retval != 0) {
+      syslog(LOG_ERR, "error initializing GPIO");
+      exit(1);
+    }
 
-  /* Set process priority. */
+    for (i = 0; i < nmodules; i++) {
+      if (ltm_display_open(&modules[i].display,
+                           modules[i].display.data_pin,
+                           modules[i].display.clock_pin,
+                           modules[i].display.reset_pin) != 0) {
+        syslog(LOG_ERR, "error initializing display %d", i);
+        exit(1);
+      }
+      ltm_display_clear(&modules[i].display);
+    }
+  }
 
-  policy_param.sched_priority = 1;
-  sched_setscheduler(0, SCHED_FIFO, &policy_param);
+  for (i = 0; i < nmodules; i++) {
+    memset(modules[i].block, 0, sizeof(modules[i].block));
+    ltm_select_groups(modules[i].block);
+
+    ltm_refresh_init(&modules[i].refresh, POLL_TIMEOUT_DATA * 1000);
+    if (kernel_fd >= 0) {
+      ltm_refresh_set_device(&modules[i].refresh, kernel_fd);
+    } else {
+      ltm_refresh_set_display(&modules[i].refresh, &modules[i].display);
+    }
+    modules[i].refresh.park_when_blank = 1;
+    ltm_refresh_set_power_cap(&modules[i].refresh, segment_ma, power_cap_ma);
+    ltm_refresh_set_frame(&modules[i].refresh, modules[i].block);
+    if (perf) {
+      ltm_refresh_enable_perf(&modules[i].refresh);
+    }
+  }
+
+  /* Keep SIGUSR1 away from the refresh thread, so it interrupts our
+     poll instead. */
+
+  sigemptyset(&signal_mask);
+  sigaddset(&signal_mask, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+
+  /* Without permission to use real-time scheduling, run the refresh
+     thread at normal priority; the display may flicker under load,
+     but it still works. */
+
+  if (runner_threads > 0) {
+    ltm_runner_init(&runner);
+    for (i = 0; i < nmodules; i++) {
+      ltm_runner_add(&runner, &modules[i].refresh);
+    }
+    retval = ltm_runner_start(&runner, runner_threads, priority);
+    if (retval == EPERM) {
+      syslog(LOG_WARNING, "no permission for real-time refresh; "
+             "running at normal priority");
+      retval = ltm_runner_start(&runner, runner_threads, 0);
+    }
+    if (retval != 0) {
+      errno = retval;
+      record_errno_error("could not start refresh threads");
+      exit(1);
+    }
+  }
+
+  for (i = 0; (runner_threads == 0) && (i < nmodules); i++) {
+    retval = ltm_refresh_start(&modules[i].refresh, priority);
+    if ((retval == EPERM) && (priority != 0)) {
+      syslog(LOG_WARNING, "no permission for real-time refresh; "
+             "running at normal priority");
+      priority = 0;
+      retval = ltm_refresh_start(&modules[i].refresh, priority);
+    }
+    if (retval != 0) {
+      errno = retval;
+      record_errno_error("could not start refresh thread");
+      exit(1);
+    }
+  }
+
+  signal(SIGUSR1, request_stats);
+  pthread_sigmask(SIG_UNBLOCK, &signal_mask, NULL);
 
   /* Open the command pipe. */
 
@@ -226,65 +1538,155 @@ int main(int argc, char *argv)
   cmd_poll[0].fd = cmd_fd;
   cmd_poll[0].events = POLLIN;
 
-  /* Initialize the display. */
+  /* Open the command socket. */
 
-  retval = gpio_init();
-  if (retval != 0) {
-    syslog(LOG_ERR, "error initializing GPIO");
+  sock_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock_fd < 0) {
+    record_errno_error("could not create command socket");
     exit(1);
   }
 
-  retval = ltm_display_init(GPIO_SEG_DATA, GPIO_SEG_CLOCK, GPIO_SEG_RESET);
+  memset(&sock_addr, 0, sizeof(sock_addr));
+  sock_addr.sun_family = AF_UNIX;
+  strncpy(sock_addr.sun_path, SOCK_PATH, sizeof(sock_addr.sun_path) - 1);
+  unlink(SOCK_PATH);
+
+  /* The socket gets its mode from the umask when it's bound, so
+     it's never writable by just anyone, even for a moment. */
+
+  old_umask = umask(0137);
+  retval = bind(sock_fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr));
+  umask(old_umask);
   if (retval != 0) {
-    syslog(LOG_ERR, "error initializing display");
+    record_errno_error("could not bind command socket");
     exit(1);
   }
 
-  ltm_clear();
+  cmd_poll[1].fd = sock_fd;
+  cmd_poll[1].events = POLLIN;
 
-  /* Enter the main loop.  We alternate between checking the pipe for
-     new commands and refreshing/updating the display. */
+  /* Wait for the refresh thread to get the first frame out, and let
+     everyone know we're ready. */
 
-  while (1) {
+  for (i = 0; i < nmodules; i++) {
+    ltm_refresh_wait_first_step(&modules[i].refresh);
+  }
+
+  first_frame_us = (modules[0].refresh.started.tv_sec - start_time.tv_sec) *
+    1000000L +
+    (modules[0].refresh.started.tv_nsec - start_time.tv_nsec) / 1000 +
+    modules[0].refresh.stats.first_step_us;
+  ready_us = since_start_us();
+  syslog(LOG_INFO, "first frame after %ld us, ready after %ld us",
+         first_frame_us, ready_us);
 
-    /* Blast the current block to the display. */
+  snprintf(notify_buf, sizeof(notify_buf),
+           "READY=1\nMAINPID=%d\nSTATUS=first frame after %ld us",
+           getpid(), first_frame_us);
+  notify_socket(notify_buf);
 
-    ltm_blast_block(block[current_block]);
+  if (ready_fd >= 0) {
+    write(ready_fd, "\n", 1);
+    close(ready_fd);
+  }
 
-    /* Set up the next block to blast. */
+  /* Enter the main loop.  The refresh thread keeps the display lit,
+     so all we do here is wait for commands, waking up in between
+     only when a data source some template uses is due, or when it's
+     time to go idle. */
 
-    current_block++;
-    if (current_block >= 5) {
-      current_block = 0;
+  last_activity_us = since_start_us();
+  while (1) {
+    timeout_ms = sources_update(&sources_changed);
+    if (sources_changed) {
+      lock_panel();
+      update_templates();
+      unlock_panel();
     }
 
-    /* Set the delay until the next refresh.  As a special case, wait
-       a really long time if our current strings are blank, so we take
-       very little CPU when we don't need to do anything. */
+    /* A writer on the pipe that began a transaction and went away
+       mustn't hold the display up for everyone else. */
 
-    if ((alphanum_string[0] != '\0') || (numeric_string[0] != '\0')) {
-      current_poll_timeout = POLL_TIMEOUT_DATA;
-    } else {
-      current_poll_timeout = POLL_TIMEOUT_BLANK;
+    if (pipe_channel.in_transaction) {
+      wait_ms = (pipe_channel.transaction_deadline_us -
+                 since_start_us()) / 1000;
+      if (wait_ms <= 0) {
+        syslog(LOG_WARNING, "transaction on command pipe timed out");
+        lock_panel();
+        end_transaction(&pipe_channel);
+        unlock_panel();
+      } else if ((timeout_ms < 0) || (wait_ms < timeout_ms)) {
+        timeout_ms = wait_ms;
+      }
     }
 
-    /* Wait for a bit, watching for any incoming commands. */
+    if ((idle_timeout_us > 0) && !idle) {
+      wait_ms = (last_activity_us + idle_timeout_us - since_start_us()) /
+        1000;
+      if (wait_ms <= 0) {
+        lock_panel();
+        enter_idle();
+        unlock_panel();
+        continue;
+      } else if ((timeout_ms < 0) || (wait_ms < timeout_ms)) {
+        timeout_ms = wait_ms;
+      }
+    }
 
-    retval = poll(cmd_poll, 1, current_poll_timeout);
+    retval = poll(cmd_poll, 2, timeout_ms);
+
+    if (stats_requested) {
+      stats_requested = 0;
+      lock_panel();
+      write_stats();
+      unlock_panel();
+    }
+
+    if (kernel_fd >= 0) {
+      lock_panel();
+      log_write_errors();
+      unlock_panel();
+    }
 
     /* Something weird happened during the poll. */
 
     if (retval < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
       record_errno_error("error watching for command");
       exit(1);
     }
 
-    /* Command data received. */
-    else if (retval > 0) {
-      bytes_read = read(cmd_fd, command_buf, 15);
-      command_buf[bytes_read] = '\0';
+    /* Command data received.  Hold the engine's lock while we work
+       through it, so everything read at once shows up together. */
+
+    if (cmd_poll[0].revents & POLLIN) {
+      bytes_read = read(cmd_fd, command_buf + command_len,
+                        CMD_BUF_SIZE - 1 - command_len);
+      if (bytes_read > 0) {
+        lock_panel();
+        note_activity(power_cap_ma);
+        command_len = process_commands(&pipe_channel, command_buf,
+                                       command_len + bytes_read,
+                                       (size_t)bytes_read <
+                                       CMD_BUF_SIZE - 1 - command_len);
+        unlock_panel();
+      }
+    }
+
+    /* Each datagram is complete in itself, so nothing carries over
+       from one to the next; that includes transactions, which end
+       with the datagram if it didn't commit them. */
+
+    if (cmd_poll[1].revents & POLLIN) {
+      bytes_read = recv(sock_fd, datagram_buf, CMD_BUF_SIZE - 1, 0);
       if (bytes_read > 0) {
-	parse_command(command_buf);
+        lock_panel();
+        note_activity(power_cap_ma);
+        process_commands(&socket_channel, datagram_buf, bytes_read, 1);
+        end_transaction(&socket_channel);
+        unlock_panel();
       }
     }
   }
@@ -0,0 +1,360 @@
+/*
+ * ltmy2kd_template.c -- templated messages for ltmy2kd.
+ *
+ * Copyright 2015 Jeff Licquia.
+ *
+ * A field can be bound to a template like "CPU{cpu:3}" instead of a
+ * fixed string.  Each {name:width} placeholder is filled in from one
+ * of the daemon's own data sources, rounded to a whole number and
+ * right-aligned in the given width (or as wide as it needs, if no
+ * width is given).  A width with a leading zero, as in {min:02},
+ * pads with zeros instead of spaces.
+ *
+ * Templates are compiled into a list of literal and placeholder
+ * parts once, when they're bound.  Each source is sampled on its own
+ * schedule, but only while some template uses it; the daemon
+ * re-expands its templates when a sample comes back different, and
+ * only redraws a field if the expanded text changed.
+ *
+ * The sources are:
+ *
+ * cpu                  percent CPU busy since the last sample
+ * load1, load5, load15 load averages
+ * temp                 SoC temperature in degrees C
+ * mem                  percent of memory in use
+ * hour, min, sec       local time
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ltmy2kd_template.h"
+
+/* The data sources. */
+
+struct source {
+  const char *name;
+  long interval_ms;
+  int (*sample)(struct source *src);
+  double value;
+  int valid;
+  int used;
+  long long next_due_ms;
+  unsigned long long state[2];
+};
+
+static int sample_cpu(struct source *src)
+{
+  FILE *f;
+  unsigned long long user, nice, system, idle, iowait, irq, softirq;
+  unsigned long long total, busy;
+
+  f = fopen("/proc/stat", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice,
+             &system, &idle, &iowait, &irq, &softirq) != 7) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  busy = user + nice + system + irq + softirq;
+  total = busy + idle + iowait;
+
+  /* The first time through, this is the average since boot. */
+
+  if (total > src->state[0]) {
+    src->value = 100.0 * (busy - src->state[1]) / (total - src->state[0]);
+  }
+  src->state[0] = total;
+  src->state[1] = busy;
+
+  return 0;
+}
+
+static int sample_load(struct source *src)
+{
+  FILE *f;
+  double load[3];
+
+  f = fopen("/proc/loadavg", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  if (fscanf(f, "%lf %lf %lf", &load[0], &load[1], &load[2]) != 3) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  src->value = load[src->state[0]];
+  return 0;
+}
+
+static int sample_temp(struct source *src)
+{
+  FILE *f;
+  long millidegrees;
+
+  f = fopen("/sys/class/thermal/thermal_zone0/temp", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  if (fscanf(f, "%ld", &millidegrees) != 1) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  src->value = millidegrees / 1000.0;
+  return 0;
+}
+
+static int sample_mem(struct source *src)
+{
+  FILE *f;
+  char line[80];
+  unsigned long total = 0, available = 0;
+
+  f = fopen("/proc/meminfo", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    sscanf(line, "MemTotal: %lu", &total);
+    sscanf(line, "MemAvailable: %lu", &available);
+  }
+  fclose(f);
+
+  if (total == 0) {
+    return -1;
+  }
+
+  src->value = 100.0 * (total - available) / total;
+  return 0;
+}
+
+static int sample_time(struct source *src)
+{
+  time_t now = time(NULL);
+  struct tm local;
+
+  localtime_r(&now, &local);
+  switch (src->state[0]) {
+  case 0:
+    src->value = local.tm_hour;
+    break;
+  case 1:
+    src->value = local.tm_min;
+    break;
+  default:
+    src->value = local.tm_sec;
+  }
+
+  return 0;
+}
+
+/* The load and time sources share a sampler; state[0] says which
+   number they want. */
+
+static struct source sources[] =
+  { { "cpu", 2000, sample_cpu },
+    { "load1", 5000, sample_load, 0, 0, 0, 0, { 0 } },
+    { "load5", 5000, sample_load, 0, 0, 0, 0, { 1 } },
+    { "load15", 5000, sample_load, 0, 0, 0, 0, { 2 } },
+    { "temp", 5000, sample_temp },
+    { "mem", 10000, sample_mem },
+    { "hour", 1000, sample_time, 0, 0, 0, 0, { 0 } },
+    { "min", 1000, sample_time, 0, 0, 0, 0, { 1 } },
+    { "sec", 1000, sample_time, 0, 0, 0, 0, { 2 } },
+    { NULL } };
+
+static long long now_ms()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static int find_source(const char *name, size_t len)
+{
+  int i;
+
+  for (i = 0; sources[i].name != NULL; i++) {
+    if ((strlen(sources[i].name) == len) &&
+        (strncmp(sources[i].name, name, len) == 0)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Take a sample and schedule the next one.  Returns nonzero if what
+   a template would show has changed. */
+
+static int sample_source(struct source *src, long long now)
+{
+  double old_value = src->value;
+  int old_valid = src->valid;
+
+  src->valid = (src->sample(src) == 0);
+  src->next_due_ms = now + src->interval_ms;
+
+  return (src->valid != old_valid) || (src->value != old_value);
+}
+
+/* Compile the template text.  Returns 0, or -1 if the text has an
+   unknown source, an unclosed brace or too many parts. */
+
+int template_compile(const char *text, struct template *t)
+{
+  const char *p = text;
+  const char *close, *colon;
+  struct template_part *part;
+  size_t len;
+
+  memset(t, 0, sizeof(struct template));
+
+  while (*p != '\0') {
+    if (t->nparts >= TEMPLATE_MAX_PARTS) {
+      return -1;
+    }
+    part = &t->parts[t->nparts];
+
+    if (*p == '{') {
+      close = strchr(p, '}');
+      if (close == NULL) {
+        return -1;
+      }
+      colon = memchr(p, ':', close - p);
+      len = ((colon != NULL) ? colon : close) - (p + 1);
+      part->source = find_source(p + 1, len);
+      if (part->source < 0) {
+        return -1;
+      }
+      if (colon != NULL) {
+        part->zero_pad = (colon[1] == '0');
+        part->width = strtol(colon + 1, NULL, 10);
+      }
+      p = close + 1;
+    } else {
+      len = strcspn(p, "{");
+      if (len >= TEMPLATE_MAX_TEXT) {
+        len = TEMPLATE_MAX_TEXT - 1;
+      }
+      part->source = -1;
+      memcpy(part->text, p, len);
+      p += len;
+    }
+
+    t->nparts++;
+  }
+
+  return 0;
+}
+
+/* Fill in the template with the latest values.  A source that can't
+   be read shows up as dashes. */
+
+void template_expand(const struct template *t, char *out, size_t out_len)
+{
+  const struct template_part *part;
+  char buf[24];
+  size_t used = 0;
+  size_t len;
+  int i;
+
+  for (i = 0; i < t->nparts; i++) {
+    part = &t->parts[i];
+    if (part->source < 0) {
+      snprintf(buf, sizeof(buf), "%s", part->text);
+    } else if (sources[part->source].valid) {
+      snprintf(buf, sizeof(buf), part->zero_pad ? "%0*.0f" : "%*.0f",
+               part->width, sources[part->source].value);
+    } else {
+      len = (part->width > 0) ? part->width : 1;
+      if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+      }
+      memset(buf, '-', len);
+      buf[len] = '\0';
+    }
+
+    len = strlen(buf);
+    if (used + len >= out_len) {
+      len = out_len - used - 1;
+    }
+    memcpy(out + used, buf, len);
+    used += len;
+  }
+
+  out[used] = '\0';
+}
+
+/* Keep track of which sources some template needs.  Sources that
+   nobody uses aren't sampled; ones that just came into use are
+   sampled right away, so a new template never shows stale values. */
+
+void sources_clear_use()
+{
+  int i;
+
+  for (i = 0; sources[i].name != NULL; i++) {
+    sources[i].used = 0;
+  }
+}
+
+void sources_use(const struct template *t)
+{
+  struct source *src;
+  long long now = now_ms();
+  int i;
+
+  for (i = 0; i < t->nparts; i++) {
+    if (t->parts[i].source >= 0) {
+      src = &sources[t->parts[i].source];
+      src->used = 1;
+      if (src->next_due_ms <= now) {
+        sample_source(src, now);
+      }
+    }
+  }
+}
+
+/* Sample any sources that are due.  Sets *changed if any value that
+   a template could show moved, and returns the number of
+   milliseconds until the next sample is due, or -1 if nothing is
+   being sampled. */
+
+long sources_update(int *changed)
+{
+  struct source *src;
+  long long now = now_ms();
+  long long next = -1;
+  int i;
+
+  *changed = 0;
+
+  for (i = 0; sources[i].name != NULL; i++) {
+    src = &sources[i];
+    if (!src->used) {
+      continue;
+    }
+
+    if ((src->next_due_ms <= now) && sample_source(src, now)) {
+      *changed = 1;
+    }
+
+    if ((next < 0) || (src->next_due_ms < next)) {
+      next = src->next_due_ms;
+    }
+  }
+
+  return (next < 0) ? -1 : (long)(next - now);
+}
@@ -4,29 +4,61 @@
  *
  * Copyright 2015 Jeff Licquia.
  *
+ * This is a diagnostic and stress tool for qualifying a board (and a
+ * GPIO backend) before running the daemon on it.  It drives the
+ * display with the library's refresh engine, showing one of several
+ * test patterns, and prints a summary of how well the engine kept up
+ * when it's done.  Each step of the pattern is posted to the engine
+ * through its lock-free update queue, as a multi-threaded program
+ * would.
+ *
+ * Usage: test_multiseg [options]
+ *
+ * -p pattern     walk (light each segment bit in turn; the default),
+ *                full (everything on), checker (alternating segments,
+ *                swapped on each step), or font (sweep through the
+ *                known characters).
+ * -r rate        refresh rate, in full passes through the five groups
+ *                per second (default 100).
+ * -d seconds     how long to run (default: long enough for one pass
+ *                through the pattern).
+ * -s ms          how long each step of the pattern stays up (default
+ *                1000).
+ * -c mA          power cap to apply, as for the daemon.
+ * -P priority    SCHED_FIFO priority of the refresh thread (default 1;
+ *                0 runs it as a normal thread).
+ * -e             count CPU cycles, instructions, context switches and
+ *                page faults for each refresh step, and show their
+ *                distributions.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <math.h>
+#include <sys/resource.h>
 
 #include "gpio.h"
 #include "ltmy2k19jf03.h"
+#include "ltm_refresh.h"
+
+#define GPIO_SEG_DATA 22
+#define GPIO_SEG_CLOCK 17
 
-/* Global state variables, for thread communication. */
+#ifdef CONFIG_RASPI_REV_A
+#define GPIO_SEG_RESET 21
+#else
+#define GPIO_SEG_RESET 27
+#endif
 
-uint8_t semaphore = 2;
+/* Number of segment bits in each group, not counting the group
+   select bits. */
 
-uint8_t block[5][5] = 
-  { { 0x00, 0x00, 0x00, 0x04, 0x00 },
-    { 0x00, 0x00, 0x00, 0x02, 0x00 },
-    { 0x00, 0x00, 0x00, 0x01, 0x00 },
-    { 0x00, 0x00, 0x00, 0x00, 0x80 },
-    { 0x00, 0x00, 0x00, 0x00, 0x40 } };
+#define SEGMENT_BITS 29
 
 /* Simple error handling. */
 
@@ -39,88 +71,181 @@ void check_error(const int retval, const char *errmsg)
   }
 }
 
-#define GPIO_SEG_DATA 22
-#define GPIO_SEG_CLOCK 17
+/* The patterns.  Each one fills in the frame for a given step, and
+   says how many steps it takes to go through the whole pattern. */
+
+const char *letters[] =
+  { "ABCDEFG",
+    "HIJKLMN",
+    "OPQRSTU",
+    "VWXYZ+-",
+    "0123456",
+    "789",
+    NULL };
+const char *numbers[] =
+  { "0123",
+    "456",
+    "7890",
+    NULL };
+
+void pattern_walk(int step, uint8_t block[5][5])
+{
+  int i;
 
-#ifdef CONFIG_RASPI_REV_A
-#define GPIO_SEG_RESET 21
-#else
-#define GPIO_SEG_RESET 27
-#endif
+  for (i = 0; i < 5; i++) {
+    block[i][step / 8] = block[i][step / 8] | (0x80 >> (step % 8));
+  }
+}
 
-/* Main loop for actual writer thread.  This does the block switching
-   thing, going through all five blocks so fast that they all appear
-   lit.  We use a very simple global semaphore to control updates. */
+void pattern_full(int step, uint8_t block[5][5])
+{
+  int i;
 
-void *blast_blocks_loop(void *arg)
+  (void)step;
+
+  for (i = 0; i < 5; i++) {
+    block[i][0] = 0xFF;
+    block[i][1] = 0xFF;
+    block[i][2] = 0xFF;
+    block[i][3] = 0xF8;
+  }
+}
+
+void pattern_checker(int step, uint8_t block[5][5])
 {
-  uint8_t local_block[5][5] = 
-    { { 0x00, 0x00, 0x00, 0x04, 0x00 },
-      { 0x00, 0x00, 0x00, 0x02, 0x00 },
-      { 0x00, 0x00, 0x00, 0x01, 0x00 },
-      { 0x00, 0x00, 0x00, 0x00, 0x80 },
-      { 0x00, 0x00, 0x00, 0x00, 0x40 } };
-  int current_block_counter = 0;
   int i, j;
+  uint8_t bits;
 
-  while (1) {
-    /* Write the current block info. */
+  for (i = 0; i < 5; i++) {
+    bits = ((i + step) % 2 == 0) ? 0xAA : 0x55;
+    for (j = 0; j < 4; j++) {
+      block[i][j] = bits;
+    }
+    block[i][3] = block[i][3] & 0xF8;
+  }
+}
 
-    ltm_blast_block(local_block[current_block_counter]);
+void pattern_font(int step, uint8_t block[5][5])
+{
+  ltm_render_alphanum(letters[step], block);
+  if (step < 3) {
+    ltm_render_numeric(numbers[step], block);
+  } else {
+    ltm_render_numeric("", block);
+  }
+}
 
-    /* Check for whether it's time to end. */
+struct pattern {
+  const char *name;
+  void (*fill)(int step, uint8_t block[5][5]);
+  int steps;
+};
 
-    pthread_testcancel();
+struct pattern patterns[] =
+  { { "walk", pattern_walk, SEGMENT_BITS },
+    { "full", pattern_full, 1 },
+    { "checker", pattern_checker, 2 },
+    { "font", pattern_font, 6 },
+    { NULL, NULL, 0 } };
 
-    /* Set up for the next block to write. */
+void usage()
+{
+  fputs("usage: test_multiseg [-p walk|full|checker|font] [-r rate]\n"
+        "                     [-d seconds] [-s step_ms] [-c cap_mA]\n"
+        "                     [-P priority] [-e]\n", stderr);
+  exit(-1);
+}
 
-    current_block_counter++;
-    if (current_block_counter > 4) {
-      current_block_counter = 0;
-    }
+/* Show what each refresh step cost, by counter. */
 
-    /* Wait until the next opportunity to run. */
+void print_perf(const struct ltm_perf *perf)
+{
+  const struct ltm_perf_dist *d;
+  int i;
+
+  printf("\nper step:          mean       p50       p99       max\n");
+  for (i = 0; i < LTM_PERF_COUNTERS; i++) {
+    if (!ltm_perf_available(perf, i)) {
+      printf("%-16s  (not available)\n", ltm_perf_name(i));
+      continue;
+    }
+    d = &perf->dist[i];
+    printf("%-16s %9.1f %9llu %9llu %9llu\n", ltm_perf_name(i),
+           d->samples ? (double)d->total / d->samples : 0.0,
+           ltm_perf_percentile(d, 50), ltm_perf_percentile(d, 99), d->max);
+  }
+}
 
-    ltm_sleep(700000);
+double elapsed_secs(const struct timespec *start)
+{
+  struct timespec now;
 
-    /* Time to grab an update. */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) +
+    (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    if (++semaphore == 1) {
-      for (i = 0; i < 5; i++) {
-        for (j = 0; j < 5; j++) {
-          local_block[i][j] = block[i][j];
+int main(int argc, char **argv)
+{
+  struct pattern *pattern = &patterns[0];
+  struct ltm_refresh refresh;
+  struct ltm_queue queue;
+  struct ltm_update update;
+  struct ltm_refresh_stats stats;
+  struct rusage usage_info;
+  uint8_t block[5][5];
+  double rate = 100.0;
+  double duration = -1.0;
+  double elapsed, remaining, process_cpu;
+  double late_mean, late_stddev;
+  long step_ms = 1000;
+  long power_cap_ma = 0;
+  int priority = 1;
+  int perf = 0;
+  int step, opt, i;
+
+  while ((opt = getopt(argc, argv, "p:r:d:s:c:P:e")) != -1) {
+    switch (opt) {
+    case 'p':
+      for (i = 0; patterns[i].name != NULL; i++) {
+        if (strcmp(patterns[i].name, optarg) == 0) {
+          break;
         }
       }
-
-      semaphore++;
-    } else if (--semaphore < 0) {
-      semaphore = 0;
+      if (patterns[i].name == NULL) {
+        usage();
+      }
+      pattern = &patterns[i];
+      break;
+    case 'r':
+      rate = strtod(optarg, NULL);
+      break;
+    case 'd':
+      duration = strtod(optarg, NULL);
+      break;
+    case 's':
+      step_ms = strtol(optarg, NULL, 10);
+      break;
+    case 'c':
+      power_cap_ma = strtol(optarg, NULL, 10);
+      break;
+    case 'P':
+      priority = strtol(optarg, NULL, 10);
+      break;
+    case 'e':
+      perf = 1;
+      break;
+    default:
+      usage();
     }
   }
 
-  /* Warning suppression; we should never get here. */
-  return NULL;
-}
-
-int main(int argc, char *argv)
-{
-  uint8_t segment_mask;
-  int segment_mask_index, i, j;
-  pthread_t blaster_thread;
-  struct sched_param sched_p;
-  const char *letters[] =
-    { "ABCDEFG",
-      "HIJKLMN",
-      "OPQRSTU",
-      "VWXYZ",
-      "0123456",
-      "789",
-      NULL };
-  const char *numbers[] =
-    { "0123",
-      "456",
-      "7890",
-      NULL };
+  if ((rate <= 0) || (step_ms <= 0)) {
+    usage();
+  }
+  if (duration < 0) {
+    duration = pattern->steps * step_ms / 1000.0;
+  }
 
   /* Initialize the GPIO system. */
 
@@ -129,91 +254,86 @@ int main(int argc, char *argv)
   check_error(ltm_display_init(GPIO_SEG_DATA, GPIO_SEG_CLOCK, GPIO_SEG_RESET),
 	      "couldn't initialize I/O to device");
 
-  /* Start the blaster loop. */
-
-  check_error(pthread_create(&blaster_thread, NULL, blast_blocks_loop, NULL),
-              "could not start thread");
-  sched_p.sched_priority = 1;
-  check_error(pthread_setschedparam(blaster_thread, SCHED_FIFO, &sched_p),
-	      "could not set thread priority");
-
-  /* Set up the next segments to light.  For now, that's one segment
-     per group. */
-
-  for (j = 0; j < 29; j++) {
-    /* Wait for the semaphore to be ready. */
-
-    while (semaphore < 2) {
-      ltm_sleep(1);
-    }
+  /* Start the refresh engine. */
 
-    /* Update the block structure with the current writes. */
+  ltm_refresh_init(&refresh, (long)(1000000.0 / (rate * 5)));
+  ltm_refresh_set_power_cap(&refresh, LTM_SEGMENT_MA, power_cap_ma);
+  ltm_queue_init(&queue);
+  ltm_refresh_set_queue(&refresh, &queue);
+  if (perf) {
+    ltm_refresh_enable_perf(&refresh);
+  }
+  check_error(ltm_refresh_start(&refresh, priority),
+              "could not start refresh thread");
 
-    segment_mask_index = j / 8;
-    segment_mask = 0x80 >> (j % 8);
+  printf("pattern %s, %.1f cycles/s (%ld us per group), %.1f s\n",
+         pattern->name, rate, refresh.period_us, duration);
 
-    for (i = 0; i < 5; i++) {
-      block[i][segment_mask_index] = block[i][segment_mask_index] | segment_mask;
-    }
+  /* Step through the pattern until the time is up. */
 
-    /* Print the first block's values for monitoring purposes. */
+  for (step = 0; (remaining = duration - elapsed_secs(&refresh.started)) > 0;
+       step++) {
+    memset(block, 0, sizeof(block));
+    pattern->fill(step % pattern->steps, block);
+    ltm_select_groups(block);
 
     printf("%02X-%02X-%02X-%02X-%02X\n", block[0][0], block[0][1],
            block[0][2], block[0][3], block[0][4]);
 
-    /* Signal the thread to update. */
-
-    semaphore = 0;
+    update.type = LTM_UPDATE_FRAME;
+    memcpy(update.data.frame, block, sizeof(block));
+    ltm_queue_post(&queue, &update);
 
-    /* Wait for it to be read back. */
+    /* Don't sleep past the end of the run on the last step. */
 
-    while (semaphore < 2) {
-      ltm_sleep(1);
+    if (remaining * 1000 < step_ms) {
+      ltm_sleep((long)(remaining * 1e6));
+    } else {
+      ltm_sleep(step_ms * 1000);
     }
-
-    /* Undo the previous writes in preparation for the next set. */
-
-    for (i = 0; i < 5; i++) {
-      block[i][segment_mask_index] = block[i][segment_mask_index] & (~segment_mask);
-    }
-
-    /* Wait. */
-
-    sleep(1);
   }
 
-  /* Now cycle through the known alphanumeric glyphs, rendering them
-     on the first alphanumeric position. */
-
-  j = 1;
-  for (i = 0; letters[i] != NULL; i++) {
-    while (semaphore < 2) {
-      ltm_sleep(1);
-    }
-
-    fputs(letters[i], stdout);
-    ltm_render_alphanum(letters[i], block);
-
-    if (j && numbers[i] != NULL) {
-      fputs(", ", stdout);
-      fputs(numbers[i], stdout);
-      ltm_render_numeric(numbers[i], block);
-    } else if (numbers[i] == NULL) {
-      j = 0;
-      ltm_render_numeric("", block);
-    };
-
-    fputc('\n', stdout);
-
-    semaphore = 0;
-
-    sleep(5);
+  /* Stop the refresh thread, and report. */
+
+  ltm_refresh_stop(&refresh);
+  elapsed = elapsed_secs(&refresh.started);
+  stats = refresh.stats;
+
+  getrusage(RUSAGE_SELF, &usage_info);
+  process_cpu = usage_info.ru_utime.tv_sec + usage_info.ru_stime.tv_sec +
+    (usage_info.ru_utime.tv_usec + usage_info.ru_stime.tv_usec) / 1e6;
+
+  printf("\n");
+  printf("elapsed:        %.2f s\n", elapsed);
+  printf("cycles:         %lu (%.1f/s, target %.1f/s)\n", stats.cycles,
+         stats.cycles / elapsed, rate);
+  printf("steps:          %lu\n", stats.steps);
+  /* The jitter is the spread of the wakeup lateness, counting the
+     steps that were on time as zero. */
+
+  late_mean = 0.0;
+  late_stddev = 0.0;
+  if (stats.steps > 0) {
+    late_mean = (double)stats.late_total_us / stats.steps;
+    late_stddev = sqrt(fmax(stats.late_squares_us2 / stats.steps -
+                            late_mean * late_mean, 0.0));
   }
 
-  /* Stop the update thread. */
-
-  pthread_cancel(blaster_thread);
-  pthread_join(blaster_thread, NULL);
+  printf("wakeup latency: mean %.1f us, stddev %.1f us, max %ld us\n",
+         late_mean, late_stddev, stats.late_max_us);
+  printf("overruns:       %lu\n", stats.overruns);
+  printf("missed steps:   %lu (over %d us late)\n", stats.deadline_misses,
+         LTM_REFRESH_SLACK_US);
+  printf("queued updates: %lu (%lu dropped)\n", stats.queue_updates,
+         atomic_load(&queue.dropped));
+  printf("refresh CPU:    %.1f%%\n", stats.cpu_us / (elapsed * 1e4));
+  printf("process CPU:    %.1f%%\n", process_cpu * 100 / elapsed);
+  printf("load estimate:  %ld mA (%ld mA capped, duty %d/1000)\n",
+         stats.load_ma, stats.capped_load_ma, stats.duty_permille);
+
+  if (perf) {
+    print_perf(&refresh.perf);
+  }
 
   /* Clean up display I/O and terminate. */
 